@@ -1,18 +1,58 @@
 /* equation boxes */
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "eqn.h"
 
+#define NGLYPHS		16	/* the size of glyph_len() cache */
+
+/*
+ * write the pending contents of box_pend to its register; the written
+ * contents are dropped from box->raw, which holds only the contents
+ * not yet in the register of boxes with a register.
+ */
+static void box_flush(void)
+{
+	struct box *box = ctx->box_pend;
+	int len = sbuf_len(&box->raw) - ctx->box_pendpos;
+	ctx->box_pend = NULL;
+	out_append(ctx->box_pendds ? ".ds " : ".as ");
+	out_append(sregname(box->reg));
+	out_append(" \"");
+	out_mem(sbuf_buf(&box->raw) + ctx->box_pendpos, len);
+	out_add('\n');
+	box->wlen += len;
+	sbuf_cut(&box->raw, ctx->box_pendpos);
+	box->pbeg = -1;
+}
+
+/* write box contents after pos to its register before any other output */
+static void box_defer(struct box *box, int pos, int ds)
+{
+	char *s = sbuf_buf(&box->raw);
+	int len = sbuf_len(&box->raw);
+	if (ctx->box_pend != box) {
+		out_defer(box_flush);
+		ctx->box_pend = box;
+		ctx->box_pendpos = pos;
+		ctx->box_pendds = ds;
+	}
+	/* a newline or a trailing backslash ends the request line */
+	if (len > pos && (s[len - 1] == '\\' || memchr(s + pos, '\n', len - pos)))
+		out_defer(NULL);
+}
+
 struct box *box_alloc(int szreg, int pre, int style)
 {
-	struct box *box = malloc(sizeof(*box));
+	struct box *box = mem_alloc(sizeof(*box));
 	memset(box, 0, sizeof(*box));
-	sbuf_init(&box->raw);
+	sbuf_initmem(&box->raw);
 	box->szreg = szreg;
 	box->atoms = 0;
 	box->style = style;
+	box->pmov = -1;
 	if (pre)
 		box->tcur = pre;
 	return box;
@@ -20,29 +60,298 @@ struct box *box_alloc(int szreg, int pre, int style)
 
 void box_free(struct box *box)
 {
+	int i;
+	if (ctx->box_pend == box)
+		out_defer(NULL);
 	if (box->reg)
 		sregrm(box->reg);
 	if (box->szown)
 		nregrm(box->szreg);
+	for (i = 0; i < LEN(box->dim); i++)
+		if (box->dim[i])
+			nregrm(box->dim[i]);
 	sbuf_done(&box->raw);
-	free(box);
+}
+
+/* append the contents of box after position pos to its register */
+static void box_echo(struct box *box, int pos)
+{
+	box->dimok = 0;
+	if (box->reg && pos < sbuf_len(&box->raw))
+		box_defer(box, pos, 0);
+}
+
+/* box_peep() token types */
+#define PT_TEXT		0	/* glyphs and escapes with no lasting effect */
+#define PT_MOVE		1	/* \h or \v */
+#define PT_FONT		2	/* \f */
+#define PT_SIZE		3	/* \s */
+#define PT_STR		4	/* \*; may change the font and size */
+
+void box_peepset(int on)
+{
+	ctx->box_peepon = on;
+}
+
+/* skip an escape argument ending with end; only \n and \( may appear */
+static char *peep_skip(char *s, int end, int glyphs)
+{
+	while (*s && *s != end && *s != '\n') {
+		if (*s != '\\') {
+			s++;
+			continue;
+		}
+		if (glyphs && s[1] == '(' && s[2] && s[3]) {
+			s += 4;
+			continue;
+		}
+		if (s[1] != 'n' || !s[2] || s[2] == '+' || s[2] == '-')
+			return NULL;
+		s += 2;
+		if (*s == '(')
+			s += s[1] && s[2] ? 2 : 0;
+		else if (*s == '[')
+			while (*s && *s != ']')
+				s++;
+		if (*s)
+			s++;
+	}
+	return *s == end ? s : NULL;
+}
+
+/* the end of the token at s, its type, and its argument; NULL if unknown */
+static char *peep_tok(char *s, int *type, char **arg, int *len)
+{
+	char *e;
+	*type = PT_TEXT;
+	if (*s != '\\')
+		return *s == '\n' ? NULL : s + 1;
+	switch (s[1]) {
+	case 'h':
+	case 'v':
+	case 'j':
+	case 'N':
+	case 'l':
+	case 'L':
+		if (s[2] != '\'' || !(e = peep_skip(s + 3, '\'', s[1] == 'l' || s[1] == 'L')))
+			return NULL;
+		if (s[1] == 'h' || s[1] == 'v')
+			*type = PT_MOVE;
+		*arg = s + 3;
+		*len = e - s - 3;
+		return e + 1;
+	case 'f':
+	case 's':
+		*type = s[1] == 'f' ? PT_FONT : PT_SIZE;
+		*arg = s + 3;
+		if (s[2] == '[') {
+			if (!(e = peep_skip(s + 3, ']', 0)))
+				return NULL;
+			*len = e - s - 3;
+			return e + 1;
+		}
+		if (s[2] == '(') {
+			*len = 2;
+			return s[3] && s[4] ? s + 5 : NULL;
+		}
+		*arg = s + 2;
+		*len = 1;
+		if (s[1] == 's' && s[2] != '0' && (s[2] < '1' || s[2] > '9' || s[3] != '\\'))
+			return NULL;
+		if (s[1] == 'f' && (!s[2] || strchr("\\\n", s[2])))
+			return NULL;
+		return s + 3;
+	case '*':
+		*type = PT_STR;
+		if (s[2] == '[')
+			return (e = peep_skip(s + 3, ']', 0)) ? e + 1 : NULL;
+		if (s[2] != '(' || !s[3] || !s[4] || strchr("\\\n", s[3]) ||
+				strchr("\\\n", s[4]))
+			return NULL;
+		return s + 5;
+	case '(':
+		if (!s[2] || !s[3] || strchr("\\\n", s[2]) || strchr("\\\n", s[3]))
+			return NULL;
+		return s + 4;
+	case '[':
+		return (e = peep_skip(s + 2, ']', 0)) ? e + 1 : NULL;
+	}
+	return s[1] && strchr(",/&^| -0", s[1]) ? s + 2 : NULL;
+}
+
+/* switch to val or to the previous value; return nonzero if a no-op */
+static int peep_switch(char st[2][FNLEN], char *val, int len, int back, int rel)
+{
+	char cur[FNLEN];
+	int nop = st[0][0] && !strcmp(st[0], st[1]);
+	strcpy(cur, st[0]);
+	if (back) {
+		strcpy(st[0], st[1]);
+		strcpy(st[1], cur);
+		return nop;
+	}
+	if (nop && !rel && strlen(cur) == len && !memcmp(cur, val, len))
+		return 1;
+	strcpy(st[1], cur);
+	st[0][0] = '\0';
+	if (!rel && len < FNLEN) {
+		memcpy(st[0], val, len);
+		st[0][len] = '\0';
+	}
+	return 0;
+}
+
+/* return nonzero if troff evaluates expression a as -b */
+static int peep_neg(char *a, int alen, char *b, int blen)
+{
+	int depth = 0;
+	int i;
+	if (alen != blen + 1 || a[0] != '-' || memcmp(a + 1, b, blen))
+		return 0;
+	for (i = 0; i < blen; i++) {
+		if (b[i] == '\\') {		/* \n escapes */
+			i += 2;
+			if (b[i] == '(')
+				i += 2;
+			else if (b[i] == '[')
+				while (b[i] != ']')
+					i++;
+		} else if (b[i] == '(') {
+			depth++;
+		} else if (b[i] == ')') {
+			depth--;
+		} else if (!depth && strchr("+-<>=&:%", b[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* return nonzero if expression s of length len is zero */
+static int peep_zero(char *s, int len)
+{
+	int i = 0;
+	if (i < len && (s[i] == '-' || s[i] == '+'))
+		i++;
+	if (i == len || s[i] != '0')
+		return 0;
+	while (i < len && s[i] == '0')
+		i++;
+	if (i < len && s[i] >= 'a' && s[i] <= 'z')
+		i++;
+	return i == len;
+}
+
+/* forget the fonts and point sizes of the contents of box */
+static void peep_reset(struct box *box)
+{
+	box->pfn[0][0] = box->pfn[1][0] = '\0';
+	box->psz[0][0] = box->psz[1][0] = '\0';
+}
+
+/*
+ * simplify the contents of box appended after pos: merge adjacent
+ * motions and drop zero motions and font and size changes that change
+ * nothing.  Only the part of the contents not written to the register
+ * is modified; the escapes there are interpolated together.  Every
+ * rewrite shortens the contents, so it is done in place.  The smallest
+ * modified position is returned.
+ */
+static int box_peep(struct box *box, int pos)
+{
+	int start = box->reg ? (ctx->box_pend == box ? ctx->box_pendpos : pos) : 0;
+	int n = sbuf_len(&box->raw);
+	char *buf = sbuf_buf(&box->raw);
+	char *r = buf + pos;		/* the next token */
+	char *w = buf + pos;		/* the end of the simplified contents */
+	char *e, *arg, *m;
+	int type, len, mlen;
+	if (!ctx->box_peepon || pos == n)
+		return pos;
+	if (box->pbeg != start) {
+		box->pbeg = start;
+		box->pmov = -1;
+		peep_reset(box);
+	}
+	while (*r) {
+		e = peep_tok(r, &type, &arg, &len);
+		if (!e || type == PT_STR)
+			peep_reset(box);
+		if (!e) {
+			memmove(w, r, buf + n - r);
+			w += buf + n - r;
+			box->pmov = -1;
+			break;
+		}
+		if (type == PT_MOVE && peep_zero(arg, len)) {
+			r = e;
+			continue;
+		}
+		if (type == PT_MOVE && box->pmov >= 0 && buf[box->pmov + 1] == r[1]) {
+			m = buf + box->pmov + 3;
+			mlen = w - m - 1;
+			pos = MIN(pos, box->pmov);
+			if (peep_neg(arg, len, m, mlen) || peep_neg(m, mlen, arg, len)) {
+				w = buf + box->pmov;
+				box->pmov = -1;
+			} else {		/* \h'a'\h'b' -> \h'a+(b)' */
+				memcpy(w - 1, "+(", 2);
+				memmove(w + 1, arg, len);
+				memcpy(w + 1 + len, ")'", 2);
+				w += len + 3;
+			}
+			r = e;
+			continue;
+		}
+		if (type == PT_FONT && peep_switch(box->pfn, arg, len,
+				!len || (len == 1 && arg[0] == 'P'), 0)) {
+			r = e;
+			continue;
+		}
+		if (type == PT_SIZE && peep_switch(box->psz, arg, len,
+				len == 1 && arg[0] == '0',
+				arg[0] == '+' || arg[0] == '-')) {
+			r = e;
+			continue;
+		}
+		box->pmov = type == PT_MOVE ? w - buf : -1;
+		if (w != r)
+			memmove(w, r, e - r);
+		w += e - r;
+		r = e;
+	}
+	sbuf_cut(&box->raw, w - buf);
+	return pos;
 }
 
 static void box_put(struct box *box, char *s)
 {
+	int pos = sbuf_len(&box->raw);
 	sbuf_append(&box->raw, s);
-	if (box->reg)
-		printf(".as %s \"%s\n", sregname(box->reg), s);
+	box_echo(box, box_peep(box, pos));
 }
 
 void box_putf(struct box *box, char *s, ...)
 {
-	char buf[LNLEN];
+	int pos = sbuf_len(&box->raw);
 	va_list ap;
 	va_start(ap, s);
-	vsnprintf(buf, sizeof(buf), s, ap);
+	sbuf_vprintf(&box->raw, s, ap);
 	va_end(ap);
-	box_put(box, buf);
+	box_echo(box, box_peep(box, pos));
+}
+
+/* insert \h'<sign><amt>u' or \v'<sign><amt>u'; dir is h or v */
+static void box_putmove(struct box *box, int dir, char *sign, char *amt)
+{
+	int pos = sbuf_len(&box->raw);
+	sbuf_add(&box->raw, '\\');
+	sbuf_add(&box->raw, dir);
+	sbuf_add(&box->raw, '\'');
+	sbuf_append(&box->raw, sign);
+	sbuf_append(&box->raw, amt);
+	sbuf_mem(&box->raw, "u'", 2);
+	box_echo(box, box_peep(box, pos));
 }
 
 char *box_buf(struct box *box)
@@ -60,10 +369,13 @@ int box_size(struct box *box, char *val)
 		box->szown = 1;
 		box->szreg = nregmk();
 	}
-	if (val[0] == '-' || val[0] == '+')
-		printf(".nr %s %s%s\n", nregname(box->szreg), nreg(szreg), val);
-	else
-		printf(".nr %s %s\n", nregname(box->szreg), val);
+	if (val[0] == '-' || val[0] == '+') {
+		char expr[LNLEN];
+		snprintf(expr, sizeof(expr), "%s%s", nreg(szreg), val);
+		nregexpr(box->szreg, expr);
+	} else {
+		nregexpr(box->szreg, val);
+	}
 	return box->szreg;
 }
 
@@ -141,7 +453,7 @@ static void box_beforeput(struct box *box, int type, int breakable)
 		}
 	}
 	if (box->tomark) {
-		printf(".nr %s 0\\w'%s'\n", box->tomark, box_toreg(box));
+		out(".nr %s 0\\w'%s'\n", box->tomark, box_toreg(box));
 		box->tomark = NULL;
 	}
 }
@@ -158,18 +470,30 @@ static void box_afterput(struct box *box, int type)
 /* insert s with the given type */
 void box_puttext(struct box *box, int type, char *s, ...)
 {
-	char buf[LNLEN];
+	struct sbuf *text = &ctx->box_text;	/* args may be clobbered */
 	va_list ap;
+	sbuf_cut(text, 0);
 	va_start(ap, s);
-	vsnprintf(buf, sizeof(buf), s, ap);
+	sbuf_vprintf(text, s, ap);
 	va_end(ap);
 	box_beforeput(box, type, 0);
 	if (!(box->tcur & T_ITALIC) && (type & T_ITALIC))
 		box_put(box, "\\,");
-	box_put(box, buf);
+	box_put(box, sbuf_buf(text));
 	box_afterput(box, type);
 }
 
+/* contents that read the same when copied once or through a string */
+static int box_plain(char *s)
+{
+	while ((s = strpbrk(s, "\\\n"))) {
+		if (*s == '\n' || !s[1] || strchr("\\*$V", s[1]))
+			return 0;
+		s += 2;
+	}
+	return 1;
+}
+
 /* append sub to box */
 void box_merge(struct box *box, struct box *sub, int breakable)
 {
@@ -177,7 +501,10 @@ void box_merge(struct box *box, struct box *sub, int breakable)
 		return;
 	box_beforeput(box, sub->tbeg, breakable);
 	box_toreg(box);
-	box_put(box, box_toreg(sub));
+	if (!sub->reg && box_plain(box_buf(sub)))
+		box_put(box, box_buf(sub));
+	else
+		box_put(box, box_toreg(sub));
 	if (!box->tbeg)
 		box->tbeg = sub->tbeg;
 	/* fix atom type only if merging a single atom */
@@ -189,46 +516,210 @@ void box_merge(struct box *box, struct box *sub, int breakable)
 	}
 }
 
+/*
+ * troff macros for recurring layouts, defined once by box_prelude();
+ * their results are left in eqn.* number registers and the eqn.br
+ * string, which should be interpolated before the next macro call.
+ */
+static char *box_macros[] = {
+	/* eqn.ba glyph: choose glyph if available and none is chosen */
+	".de eqn.ba",
+	".if '\\\\*[eqn.br]'' .if \\w'\\\\$1' .ds eqn.br \"\\\\$1",
+	"..",
+	/* eqn.bs ht dp rulethickness axisheight glyph: a large enough bracket */
+	".de eqn.bs",
+	".if '\\\\*[eqn.br]'' .if \\w'\\\\$5' "
+	".if (\\\\$1-(\\\\$3m/100)*2)<=(-\\\\n[bbury]+\\\\n[bblly]+(\\\\$4m/100*2)) "
+	".if (\\\\$2*2)<=(-\\\\n[bbury]+\\\\n[bblly]-(\\\\$4m/100*2)) "
+	".ds eqn.br \"\\\\$5",
+	"..",
+	/* eqn.bt ht dp glyph: a bracket not shorter than ht+dp */
+	".de eqn.bt",
+	".if '\\\\*[eqn.br]'' .if \\w'\\\\$3' "
+	".if (\\\\$1+\\\\$2)<=(-\\\\n[bbury]+\\\\n[bblly]) .ds eqn.br \"\\\\$3",
+	"..",
+	/* eqn.ml x glyph: measure a bracket piece into eqn.x[wldh] */
+	".de eqn.ml",
+	".nr eqn.\\\\$1w 0\\w'\\\\$2'",
+	".nr eqn.\\\\$1l 0\\\\n[bblly]-\\\\n[bbury]-2",
+	".nr eqn.\\\\$1d 0\\\\n[bblly]-1",
+	".nr eqn.\\\\$1h 0-\\\\n[bbury]-1",
+	"..",
+	/* eqn.bx: append the middle pieces and the center piece */
+	".de eqn.bx",
+	".if \\\\n[eqn.i]=\\\\n[eqn.cp] .as eqn.br "
+	"\"\\v'-\\\\n[eqn.cd]u'\\\\*[eqn.c]\\h'-\\\\n[eqn.cw]u'\\v'-\\\\n[eqn.ch]u'",
+	".if \\\\n[eqn.i]<\\\\n[eqn.n] .as eqn.br "
+	"\"\\v'-\\\\n[eqn.md]u'\\\\*[eqn.m]\\h'-\\\\n[eqn.mw]u'\\v'-\\\\n[eqn.mh]u'",
+	".if \\\\n+[eqn.i]<\\\\n[eqn.n] .eqn.bx",
+	"..",
+	/* eqn.be top bot cenlen wd: stack the pieces of a bracket */
+	".de eqn.be",
+	".ds eqn.br \"\\v'-\\\\n[eqn.bd]u'\\\\$2\\h'-\\\\n[eqn.bw]u'\\v'-\\\\n[eqn.bh]u'",
+	".nr eqn.i 0 1",
+	".eqn.bx",
+	".as eqn.br \"\\v'-\\\\n[eqn.td]u'\\\\$1\\h'-\\\\n[eqn.tw]u'\\v'-\\\\n[eqn.th]u'",
+	".as eqn.br "
+	"\"\\v'\\\\n[eqn.n]u*\\\\n[eqn.ml]u+\\\\n[eqn.bl]u+\\\\n[eqn.tl]u+\\\\$3u'",
+	".as eqn.br \"\\h'\\\\$4u'",
+	"..",
+	/* eqn.bm len top mid bot: build a bracket */
+	".de eqn.bm",
+	".eqn.ml t \\\\$2",
+	".eqn.ml m \\\\$3",
+	".eqn.ml b \\\\$4",
+	".ds eqn.m \"\\\\$3",
+	".nr eqn.cp 0-1",
+	".nr eqn.n 0\\\\$1*2-\\\\n[eqn.tl]-\\\\n[eqn.bl]*11/10/\\\\n[eqn.ml]",
+	".if \\\\n[eqn.n]<0 .nr eqn.n 0",
+	".eqn.be \\\\$2 \\\\$4 0 \\\\n[eqn.mw]",
+	"..",
+	/* eqn.bc len top mid bot cen: build a bracket with a center like { */
+	".de eqn.bc",
+	".eqn.ml t \\\\$2",
+	".eqn.ml m \\\\$3",
+	".eqn.ml b \\\\$4",
+	".eqn.ml c \\\\$5",
+	".ds eqn.m \"\\\\$3",
+	".ds eqn.c \"\\\\$5",
+	".nr eqn.cp 0\\\\$1-(\\\\n[eqn.cl]+\\\\n[eqn.tl]+\\\\n[eqn.bl]/2)*11/10/\\\\n[eqn.ml]",
+	".if \\\\n[eqn.cp]<0 .nr eqn.cp 0",
+	".nr eqn.n 0\\\\n[eqn.cp]*2",
+	".eqn.be \\\\$2 \\\\$4 \\\\n[eqn.cl] \\\\n[eqn.cw]",
+	"..",
+	/* eqn.fr numdp denht barht bardp num denom axisheight rulethickness gap */
+	".de eqn.fr",
+	".nr eqn.nr 0\\\\$5m/100u",
+	".nr eqn.df 0\\\\$6m/100u",
+	/* 15d */
+	".nr eqn.t (\\\\n[eqn.nr]-\\\\$1)-((\\\\$7m/100u)+(\\\\$8m/100u/2))",
+	".if \\\\n[eqn.t]<(\\\\$9m/100u) .nr eqn.nr +(\\\\$9m/100u)-\\\\n[eqn.t]",
+	".nr eqn.t ((\\\\$7m/100u)-(\\\\$8m/100u/2))-(\\\\$2-\\\\n[eqn.df])",
+	".if \\\\n[eqn.t]<(\\\\$9m/100u) .nr eqn.df +(\\\\$9m/100u)-\\\\n[eqn.t]",
+	/* the vertical position of the bar */
+	".nr eqn.bf 0-\\\\$4+\\\\$3/2-(\\\\$7m/100u)",
+	"..",
+	/* eqn.sp ht supdp supdrop suprise xheight: superscript rise (18a, 18c) */
+	".de eqn.sp",
+	".nr eqn.sr 0\\\\$1u-(\\\\$3m/100u)",
+	".if \\\\n[eqn.sr]<(\\\\$4m/100u) .nr eqn.sr (\\\\$4m/100u)",
+	".if \\\\n[eqn.sr]<(\\\\$2+(\\\\$5m/100u/4)) .nr eqn.sr 0\\\\$2+(\\\\$5m/100u/4)",
+	"..",
+	/* eqn.sb dp subht subdrop sub1 xheight: subscript fall (18a, 18b) */
+	".de eqn.sb",
+	".nr eqn.sf 0\\\\$1u+(\\\\$3m/100u)",
+	".if \\\\n[eqn.sf]<(\\\\$4m/100u) .nr eqn.sf (\\\\$4m/100u)",
+	".if \\\\n[eqn.sf]<(\\\\$2-(\\\\$5m/100u*4/5)) .nr eqn.sf 0\\\\$2-(\\\\$5m/100u*4/5)",
+	"..",
+	/* eqn.ss dp subht subdrop sub2 supdp rulethickness xheight: 18a, 18d, 18e */
+	".de eqn.ss",
+	".nr eqn.sf 0\\\\$1u+(\\\\$3m/100u)",
+	".if \\\\n[eqn.sf]<(\\\\$4m/100u) .nr eqn.sf (\\\\$4m/100u)",
+	".if (\\\\n[eqn.sr]-\\\\$5)-(\\\\$2-\\\\n[eqn.sf])<(\\\\$6m/100u*4) \\{\\",
+	".nr eqn.sf (\\\\$6m/100u*4)+\\\\$2-(\\\\n[eqn.sr]-\\\\$5)",
+	".nr eqn.t (\\\\$7m/100u*4/5)-(\\\\n[eqn.sr]-\\\\$5)",
+	".if \\\\n[eqn.t]>0 .nr eqn.sr +\\\\n[eqn.t]",
+	".if \\\\n[eqn.t]>0 .nr eqn.sf -\\\\n[eqn.t] \\}",
+	"..",
+	/* eqn.sc wd wdnoic ht: subscript correction */
+	".de eqn.sc",
+	".nr eqn.sc (\\\\$1-\\\\$2)",
+	".if \\\\$3>0 .nr eqn.sc (\\\\$3+\\\\n[eqn.sf])*(\\\\$1-\\\\$2)/\\\\$3",
+	"..",
+};
+
+/* start an equation; define the macros in box_macros[] once */
+void box_prelude(void)
+{
+	int i;
+	ctx->box_env++;		/* troff's point size and font are unknown */
+	ctx->box_ps[0] = '\0';
+	ctx->box_ft[0] = '\0';
+	if (ctx->box_predone++)
+		return;
+	for (i = 0; i < LEN(box_macros); i++) {
+		out_append(box_macros[i]);
+		out_add('\n');
+	}
+}
+
 /* put the maximum of number registers a and b into register dst */
 static void roff_max(int dst, int a, int b)
 {
-	printf(".ie %s>=%s .nr %s 0+%s\n",
+	out(".ie %s>=%s .nr %s 0+%s\n",
 		nreg(a), nreg(b), nregname(dst), nreg(a));
-	printf(".el .nr %s 0+%s\n", nregname(dst), nreg(b));
+	out(".el .nr %s 0+%s\n", nregname(dst), nreg(b));
 }
 
 /* return the width, height and depth of a string */
 static void tok_dim(char *s, int wd, int ht, int dp)
 {
-	printf(".nr %s 0\\w'%s'\n", nregname(wd), s);
+	out(".nr %s 0\\w'%s'\n", nregname(wd), s);
 	if (ht)
-		printf(".nr %s 0-\\n[bbury]\n", nregname(ht));
+		out(".nr %s 0-\\n[bbury]\n", nregname(ht));
 	if (dp)
-		printf(".nr %s 0\\n[bblly]\n", nregname(dp));
+		out(".nr %s 0\\n[bblly]\n", nregname(dp));
+}
+
+/* set troff's point size to the value of number register szreg */
+static void box_ps(int szreg)
+{
+	char *sz = nreg(szreg);
+	out(".ps %s\n", sz);
+	if (strcmp(ctx->box_ps, sz) || ctx->box_psver != nregver(szreg)) {
+		snprintf(ctx->box_ps, sizeof(ctx->box_ps), "%s", sz);
+		ctx->box_psver = nregver(szreg);
+		ctx->box_env++;
+	}
+}
+
+/* set troff's font */
+void box_font(char *fn)
+{
+	out(".ft %s\n", fn);
+	if (strcmp(ctx->box_ft, fn) || strchr(fn, '\\')) {
+		snprintf(ctx->box_ft, sizeof(ctx->box_ft), "%s", fn);
+		ctx->box_env++;
+	}
+}
+
+/*
+ * measure box into box->dim[] and its height and depth too if ht and
+ * dp are nonzero; the dimensions remain valid until the contents of
+ * box or troff's point size or font change
+ */
+static void box_dim(struct box *box, int ht, int dp)
+{
+	int need = 1 | (ht ? 2 : 0) | (dp ? 4 : 0);
+	int i;
+	if (box->dimenv != ctx->box_env)
+		box->dimok = 0;
+	if ((box->dimok & need) == need)
+		return;
+	for (i = 0; i < LEN(box->dim); i++)
+		if (need & (1 << i) && !box->dim[i])
+			box->dim[i] = nregmk();
+	tok_dim(box_toreg(box), box->dim[0],
+		ht ? box->dim[1] : 0, dp ? box->dim[2] : 0);
+	box->dimok |= need;
+	box->dimenv = ctx->box_env;
 }
 
 static int box_suprise(struct box *box)
 {
 	if (TS_0(box->style))
-		return e_sup3;
-	return box->style == TS_D ? e_sup1 : e_sup2;
+		return ctx->e_sup3;
+	return box->style == TS_D ? ctx->e_sup1 : ctx->e_sup2;
 }
 
 void box_sub(struct box *box, struct box *sub, struct box *sup)
 {
-	int box_wd = nregmk();
+	int box_wd, box_ht, box_dp;
 	int box_wdnoic = nregmk();
-	int box_dp = nregmk();
-	int box_ht = nregmk();
 	int sub_wd = nregmk();
-	int sup_wd = nregmk();
+	int sup_wd, sup_dp;
 	int all_wd = nregmk();
-	int sup_dp = nregmk();
 	int sub_ht = nregmk();
-	int sup_rise = nregmk();
-	int sub_fall = nregmk();
-	int tmp_18e = nregmk();
-	int sub_cor = nregmk();
 	if (sub)
 		box_italiccorrection(sub);
 	if (sup)
@@ -236,125 +727,89 @@ void box_sub(struct box *box, struct box *sub, struct box *sup)
 	if (sub)
 		tok_dim(box_toreg(box), box_wdnoic, 0, 0);
 	box_italiccorrection(box);
-	printf(".ps %s\n", nreg(box->szreg));
-	tok_dim(box_toreg(box), box_wd, box_ht, box_dp);
+	box_ps(box->szreg);
+	box_dim(box, 1, 1);
+	box_wd = box->dim[0];
+	box_ht = box->dim[1];
+	box_dp = box->dim[2];
 	box_putf(box, "\\h'5m/100u'");
 	if (sup) {
-		tok_dim(box_toreg(sup), sup_wd, 0, sup_dp);
-		/* 18a */
-		printf(".nr %s 0%su-(%dm/100u)\n",
-			nregname(sup_rise), nreg(box_ht), e_supdrop);
-		/* 18c */
-		printf(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
-			nreg(sup_rise), box_suprise(box),
-			nregname(sup_rise), box_suprise(box));
-		printf(".if %s<(%s+(%dm/100u/4)) .nr %s 0%s+(%dm/100u/4)\n",
-			nreg(sup_rise), nreg(sup_dp), e_xheight,
-			nregname(sup_rise), nreg(sup_dp), e_xheight);
+		box_dim(sup, 0, 1);
+		sup_wd = sup->dim[0];
+		sup_dp = sup->dim[2];
+		/* 18a and 18c */
+		out(".eqn.sp %s %s %d %d %d\n", nreg(box_ht), nreg(sup_dp),
+			ctx->e_supdrop, box_suprise(box), ctx->e_xheight);
 	}
-	if (sub) {
+	if (sub)
 		tok_dim(box_toreg(sub), sub_wd, sub_ht, 0);
-		/* 18a */
-		printf(".nr %s 0%su+(%dm/100u)\n",
-			nregname(sub_fall), nreg(box_dp), e_subdrop);
-	}
-	if (sub && !sup) {
-		/* 18b */
-		printf(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
-			nreg(sub_fall), e_sub1,
-			nregname(sub_fall), e_sub1);
-		printf(".if %s<(%s-(%dm/100u*4/5)) .nr %s 0%s-(%dm/100u*4/5)\n",
-			nreg(sub_fall), nreg(sub_ht), e_xheight,
-			nregname(sub_fall), nreg(sub_ht), e_xheight);
-	}
-	if (sub && sup) {
-		/* 18d */
-		printf(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
-			nreg(sub_fall), e_sub2,
-			nregname(sub_fall), e_sub2);
-		/* 18e */
-		printf(".if (%s-%s)-(%s-%s)<(%dm/100u*4) \\{\\\n",
-			nreg(sup_rise), nreg(sup_dp),
-			nreg(sub_ht), nreg(sub_fall), e_rulethickness);
-		printf(".nr %s (%dm/100u*4)+%s-(%s-%s)\n",
-			nregname(sub_fall), e_rulethickness,
-			nreg(sub_ht), nreg(sup_rise), nreg(sup_dp));
-		printf(".nr %s (%dm/100u*4/5)-(%s-%s)\n",
-			nregname(tmp_18e), e_xheight,
-			nreg(sup_rise), nreg(sup_dp));
-		printf(".if %s>0 .nr %s +%s\n",
-			nreg(tmp_18e), nregname(sup_rise), nreg(tmp_18e));
-		printf(".if %s>0 .nr %s -%s \\}\n",
-			nreg(tmp_18e), nregname(sub_fall), nreg(tmp_18e));
-	}
+	if (sub && !sup)	/* 18a and 18b */
+		out(".eqn.sb %s %s %d %d %d\n", nreg(box_dp), nreg(sub_ht),
+			ctx->e_subdrop, ctx->e_sub1, ctx->e_xheight);
+	if (sub && sup)		/* 18a, 18d, and 18e */
+		out(".eqn.ss %s %s %d %d %s %d %d\n", nreg(box_dp), nreg(sub_ht),
+			ctx->e_subdrop, ctx->e_sub2, nreg(sup_dp),
+			ctx->e_rulethickness, ctx->e_xheight);
 	/* writing the superscript */
 	if (sup) {
-		box_putf(box, "\\v'-%su'%s\\v'%su'",
-			nreg(sup_rise), box_toreg(sup), nreg(sup_rise));
+		box_putf(box, "\\v'-\\n[eqn.sr]u'%s\\v'\\n[eqn.sr]u'",
+			box_toreg(sup));
 		if (sub)
-			box_putf(box, "\\h'-%su'", nreg(sup_wd));
+			box_putmove(box, 'h', "-", nreg(sup_wd));
 	}
 	/* writing the subscript */
 	if (sub) {
 		/* subscript correction */
-		printf(".nr %s (%s-%s)\n", nregname(sub_cor),
-			nreg(box_wd), nreg(box_wdnoic));
-		printf(".if %s>0 .nr %s (%s+%s)*(%s-%s)/%s\n",
-			nreg(box_ht), nregname(sub_cor),
-			nreg(box_ht), nreg(sub_fall),
+		out(".eqn.sc %s %s %s\n",
 			nreg(box_wd), nreg(box_wdnoic), nreg(box_ht));
-		printf(".nr %s -%s\n", nregname(sub_wd), nreg(sub_cor));
-		box_putf(box, "\\h'-%su'", nreg(sub_cor));
-		box_putf(box, "\\v'%su'%s\\v'-%su'",
-			nreg(sub_fall), box_toreg(sub), nreg(sub_fall));
+		out(".nr %s -\\n[eqn.sc]\n", nregname(sub_wd));
+		box_putmove(box, 'h', "-", "\\n[eqn.sc]");
+		box_putf(box, "\\v'\\n[eqn.sf]u'%s\\v'-\\n[eqn.sf]u'",
+			box_toreg(sub));
 		if (sup) {
-			box_putf(box, "\\h'-%su'", nreg(sub_wd));
+			box_putmove(box, 'h', "-", nreg(sub_wd));
 			roff_max(all_wd, sub_wd, sup_wd);
-			box_putf(box, "\\h'+%su'", nreg(all_wd));
+			box_putmove(box, 'h', "+", nreg(all_wd));
 		}
 	}
-	box_putf(box, "\\h'%dm/100u'", e_scriptspace);
-	nregrm(box_wd);
+	box_putf(box, "\\h'%dm/100u'", ctx->e_scriptspace);
 	nregrm(box_wdnoic);
-	nregrm(box_dp);
-	nregrm(box_ht);
 	nregrm(sub_wd);
-	nregrm(sup_wd);
 	nregrm(all_wd);
-	nregrm(sup_dp);
 	nregrm(sub_ht);
-	nregrm(sup_rise);
-	nregrm(sub_fall);
-	nregrm(tmp_18e);
-	nregrm(sub_cor);
 }
 
 void box_from(struct box *box, struct box *lim, struct box *llim, struct box *ulim)
 {
-	int lim_wd = nregmk();		/* box's width */
-	int lim_ht = nregmk();		/* box's height */
-	int lim_dp = nregmk();		/* box's depth */
-	int llim_wd = nregmk();		/* llim's width */
-	int ulim_wd = nregmk();		/* ulim's width */
-	int ulim_dp = nregmk();		/* ulim's depth */
-	int llim_ht = nregmk();		/* llim's height */
+	int lim_wd, lim_ht, lim_dp;	/* lim's width, height and depth */
+	int llim_wd = 0, llim_ht = 0;	/* llim's width and height */
+	int ulim_wd = 0, ulim_dp = 0;	/* ulim's width and depth */
 	int ulim_rise = nregmk();	/* the position of ulim */
 	int llim_fall = nregmk();	/* the position of llim */
 	int all_wd = nregmk();		/* the width of all */
 	box_italiccorrection(lim);
 	box_beforeput(box, T_BIGOP, 0);
-	tok_dim(box_toreg(lim), lim_wd, lim_ht, lim_dp);
-	printf(".ps %s\n", nreg(box->szreg));
-	if (ulim)
-		tok_dim(box_toreg(ulim), ulim_wd, 0, ulim_dp);
-	if (llim)
-		tok_dim(box_toreg(llim), llim_wd, llim_ht, 0);
+	box_dim(lim, 1, 1);
+	lim_wd = lim->dim[0];
+	lim_ht = lim->dim[1];
+	lim_dp = lim->dim[2];
+	box_ps(box->szreg);
+	if (ulim) {
+		box_dim(ulim, 0, 1);
+		ulim_wd = ulim->dim[0];
+		ulim_dp = ulim->dim[2];
+	}
+	if (llim) {
+		box_dim(llim, 1, 0);
+		llim_wd = llim->dim[0];
+		llim_ht = llim->dim[1];
+	}
 	if (ulim && llim)
 		roff_max(all_wd, llim_wd, ulim_wd);
 	else
-		printf(".nr %s %s\n", nregname(all_wd),
+		out(".nr %s %s\n", nregname(all_wd),
 			ulim ? nreg(ulim_wd) : nreg(llim_wd));
-	printf(".if %s>%s .nr %s 0%s\n",
+	out(".if %s>%s .nr %s 0%s\n",
 		nreg(lim_wd), nreg(all_wd),
 		nregname(all_wd), nreg(lim_wd));
 	box_putf(box, "\\h'%su-%su/2u'", nreg(all_wd), nreg(lim_wd));
@@ -362,12 +817,12 @@ void box_from(struct box *box, struct box *lim, struct box *llim, struct box *ul
 	box_putf(box, "\\h'-%su/2u'", nreg(lim_wd));
 	if (ulim) {
 		/* 13a */
-		printf(".nr %s (%dm/100u)-%s\n",
-			nregname(ulim_rise), e_bigopspacing3, nreg(ulim_dp));
-		printf(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
-			nreg(ulim_rise), e_bigopspacing1,
-			nregname(ulim_rise), e_bigopspacing1);
-		printf(".nr %s +%s+%s\n",
+		out(".nr %s (%dm/100u)-%s\n",
+			nregname(ulim_rise), ctx->e_bigopspacing3, nreg(ulim_dp));
+		out(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
+			nreg(ulim_rise), ctx->e_bigopspacing1,
+			nregname(ulim_rise), ctx->e_bigopspacing1);
+		out(".nr %s +%s+%s\n",
 			nregname(ulim_rise), nreg(lim_ht), nreg(ulim_dp));
 		box_putf(box, "\\h'-%su/2u'\\v'-%su'%s\\v'%su'\\h'-%su/2u'",
 			nreg(ulim_wd), nreg(ulim_rise), box_toreg(ulim),
@@ -375,12 +830,12 @@ void box_from(struct box *box, struct box *lim, struct box *llim, struct box *ul
 	}
 	if (llim) {
 		/* 13a */
-		printf(".nr %s (%dm/100u)-%s\n",
-			nregname(llim_fall), e_bigopspacing4, nreg(llim_ht));
-		printf(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
-			nreg(llim_fall), e_bigopspacing2,
-			nregname(llim_fall), e_bigopspacing2);
-		printf(".nr %s +%s+%s\n",
+		out(".nr %s (%dm/100u)-%s\n",
+			nregname(llim_fall), ctx->e_bigopspacing4, nreg(llim_ht));
+		out(".if %s<(%dm/100u) .nr %s (%dm/100u)\n",
+			nreg(llim_fall), ctx->e_bigopspacing2,
+			nregname(llim_fall), ctx->e_bigopspacing2);
+		out(".nr %s +%s+%s\n",
 			nregname(llim_fall), nreg(lim_dp), nreg(llim_ht));
 		box_putf(box, "\\h'-%su/2u'\\v'%su'%s\\v'-%su'\\h'-%su/2u'",
 			nreg(llim_wd), nreg(llim_fall), box_toreg(llim),
@@ -388,13 +843,6 @@ void box_from(struct box *box, struct box *lim, struct box *llim, struct box *ul
 	}
 	box_putf(box, "\\h'%su/2u'", nreg(all_wd));
 	box_afterput(box, T_BIGOP);
-	nregrm(lim_wd);
-	nregrm(lim_ht);
-	nregrm(lim_dp);
-	nregrm(llim_wd);
-	nregrm(ulim_wd);
-	nregrm(ulim_dp);
-	nregrm(llim_ht);
 	nregrm(ulim_rise);
 	nregrm(llim_fall);
 	nregrm(all_wd);
@@ -403,13 +851,57 @@ void box_from(struct box *box, struct box *lim, struct box *llim, struct box *ul
 /* return the width of s; len is the height plus depth */
 static void tok_len(char *s, int wd, int len, int ht, int dp)
 {
-	printf(".nr %s 0\\w'%s'\n", nregname(wd), s);
+	out(".nr %s 0\\w'%s'\n", nregname(wd), s);
 	if (len)
-		printf(".nr %s 0\\n[bblly]-\\n[bbury]-2\n", nregname(len));
+		out(".nr %s 0\\n[bblly]-\\n[bbury]-2\n", nregname(len));
 	if (dp)
-		printf(".nr %s 0\\n[bblly]-1\n", nregname(dp));
+		out(".nr %s 0\\n[bblly]-1\n", nregname(dp));
 	if (ht)
-		printf(".nr %s 0-\\n[bbury]-1\n", nregname(ht));
+		out(".nr %s 0-\\n[bbury]-1\n", nregname(ht));
+}
+
+/* glyph metrics, measured once for each font and point size */
+struct glyph {
+	char *s;		/* the glyph; a string constant */
+	int len[4];		/* as in blen_mk() */
+	int llx;		/* the left edge of the bounding box */
+	int sz, fn;		/* point size and font of the measurement */
+	int env;		/* box_env when last checked */
+};
+
+/* measure s in troff's current font and size, unless already measured */
+static struct glyph *glyph_len(char *s)
+{
+	struct glyph *g;
+	int i;
+	for (i = 0; i < ctx->glyphs_n && strcmp(ctx->glyphs[i].s, s); i++)
+		;
+	g = &ctx->glyphs[MIN(i, NGLYPHS - 1)];
+	if (i == ctx->glyphs_n && i < NGLYPHS) {
+		g->s = s;
+		for (i = 0; i < LEN(g->len); i++)
+			g->len[i] = nregkeep();
+		g->llx = nregkeep();
+		g->sz = nregkeep();
+		g->fn = nregkeep();
+		ctx->glyphs_n++;
+	}
+	if (strcmp(g->s, s)) {		/* shared by the remaining glyphs */
+		g->s = s;
+		g->env = 0;
+		out(".nr %s 0\n", nregname(g->sz));
+	}
+	if (g->env == ctx->box_env)	/* troff's size and font are unchanged */
+		return g;
+	g->env = ctx->box_env;
+	out(".if !(\\n(.s=%s)&(\\n(.f=%s) \\{\\\n",
+		nreg(g->sz), nreg(g->fn));
+	out(".nr %s \\n(.s\n", nregname(g->sz));
+	out(".nr %s \\n(.f\n", nregname(g->fn));
+	tok_len(s, g->len[0], g->len[1], g->len[2], g->len[3]);
+	out(".nr %s \\n[bbllx]\n", nregname(g->llx));
+	out(".  \\}\n");
+	return g;
 }
 
 /* len[0]: width, len[1]: vertical length, len[2]: height, len[3]: depth */
@@ -432,207 +924,102 @@ static void blen_rm(int len[4])
 /* build a fraction; the correct font should be set up beforehand */
 void box_over(struct box *box, struct box *num, struct box *den)
 {
-	int num_wd = nregmk();
-	int num_dp = nregmk();
-	int den_wd = nregmk();
-	int den_ht = nregmk();
+	int num_wd, num_dp;
+	int den_wd, den_ht;
 	int all_wd = nregmk();
-	int num_rise = nregmk();
-	int den_fall = nregmk();
-	int bar_wd = nregmk();
-	int bar_dp = nregmk();
-	int bar_ht = nregmk();
-	int bar_fall = nregmk();
-	int tmp_15d = nregmk();
-	int bargap = (TS_DX(box->style) ? 7 : 3) * e_rulethickness / 2;
+	struct glyph *bar;
+	int bargap = (TS_DX(box->style) ? 7 : 3) * ctx->e_rulethickness / 2;
 	box_beforeput(box, T_INNER, 0);
 	box_italiccorrection(num);
 	box_italiccorrection(den);
-	tok_dim(box_toreg(num), num_wd, 0, num_dp);
-	tok_dim(box_toreg(den), den_wd, den_ht, 0);
+	box_dim(num, 0, 1);
+	num_wd = num->dim[0];
+	num_dp = num->dim[2];
+	box_dim(den, 1, 0);
+	den_wd = den->dim[0];
+	den_ht = den->dim[1];
 	roff_max(all_wd, num_wd, den_wd);
-	printf(".ps %s\n", nreg(box->szreg));
-	tok_len("\\(ru", bar_wd, 0, bar_ht, bar_dp);
-	/* 15b */
-	printf(".nr %s 0%dm/100u\n",
-		nregname(num_rise), TS_DX(box->style) ? e_num1 : e_num2);
-	printf(".nr %s 0%dm/100u\n",
-		nregname(den_fall), TS_DX(box->style) ? e_denom1 : e_denom2);
-	/* 15d */
-	printf(".nr %s (%s-%s)-((%dm/100u)+(%dm/100u/2))\n",
-		nregname(tmp_15d), nreg(num_rise), nreg(num_dp),
-		e_axisheight, e_rulethickness);
-	printf(".if %s<(%dm/100u) .nr %s +(%dm/100u)-%s\n",
-		nreg(tmp_15d), bargap, nregname(num_rise),
-		bargap, nreg(tmp_15d));
-	printf(".nr %s ((%dm/100u)-(%dm/100u/2))-(%s-%s)\n",
-		nregname(tmp_15d), e_axisheight, e_rulethickness,
-		nreg(den_ht), nreg(den_fall));
-	printf(".if %s<(%dm/100u) .nr %s +(%dm/100u)-%s\n",
-		nreg(tmp_15d), bargap, nregname(den_fall),
-		bargap, nreg(tmp_15d));
-	/* calculating the vertical position of the bar */
-	printf(".nr %s 0-%s+%s/2-(%dm/100u)\n",
-		nregname(bar_fall), nreg(bar_dp),
-		nreg(bar_ht), e_axisheight);
+	box_ps(box->szreg);
+	bar = glyph_len("\\(ru");
+	/* the positions of the numerator, the denominator, and the bar */
+	out(".eqn.fr %s %s %s %s %d %d %d %d %d\n",
+		nreg(num_dp), nreg(den_ht), nreg(bar->len[2]), nreg(bar->len[3]),
+		TS_DX(box->style) ? ctx->e_num1 : ctx->e_num2,
+		TS_DX(box->style) ? ctx->e_denom1 : ctx->e_denom2,
+		ctx->e_axisheight, ctx->e_rulethickness, bargap);
 	/* making the bar longer */
-	printf(".nr %s +2*(%dm/100u)\n",
-		nregname(all_wd), e_overhang);
+	out(".nr %s +2*(%dm/100u)\n",
+		nregname(all_wd), ctx->e_overhang);
 	/* null delimiter space */
-	box_putf(box, "\\h'%sp*%du/100u'",nreg(box->szreg), e_nulldelim);
+	box_putf(box, "\\h'%sp*%du/100u'",nreg(box->szreg), ctx->e_nulldelim);
 	/* drawing the bar */
-	box_putf(box, "\\v'%su'\\f[\\n(.f]\\s[%s]\\l'%su'\\v'-%su'\\h'-%su/2u'",
-		nreg(bar_fall), nreg(box->szreg), nreg(all_wd),
-		nreg(bar_fall), nreg(all_wd));
+	box_putf(box, "\\v'\\n[eqn.bf]u'\\f[\\n(.f]\\s[%s]\\l'%su'\\v'-\\n[eqn.bf]u'\\h'-%su/2u'",
+		nreg(box->szreg), nreg(all_wd), nreg(all_wd));
 	/* output the numerator */
 	box_putf(box, "\\h'-%su/2u'", nreg(num_wd));
-	box_putf(box, "\\v'-%su'%s\\v'%su'",
-		nreg(num_rise), box_toreg(num), nreg(num_rise));
+	box_putf(box, "\\v'-\\n[eqn.nr]u'%s\\v'\\n[eqn.nr]u'", box_toreg(num));
 	box_putf(box, "\\h'-%su/2u'", nreg(num_wd));
 	/* output the denominator */
 	box_putf(box, "\\h'-%su/2u'", nreg(den_wd));
-	box_putf(box, "\\v'%su'%s\\v'-%su'",
-		nreg(den_fall), box_toreg(den), nreg(den_fall));
+	box_putf(box, "\\v'\\n[eqn.df]u'%s\\v'-\\n[eqn.df]u'", box_toreg(den));
 	box_putf(box, "\\h'(-%su+%su)/2u'", nreg(den_wd), nreg(all_wd));
-	box_putf(box, "\\h'%sp*%du/100u'",nreg(box->szreg), e_nulldelim);
+	box_putf(box, "\\h'%sp*%du/100u'",nreg(box->szreg), ctx->e_nulldelim);
 	box_afterput(box, T_INNER);
 	box_toreg(box);
-	nregrm(num_wd);
-	nregrm(num_dp);
-	nregrm(den_wd);
-	nregrm(den_ht);
 	nregrm(all_wd);
-	nregrm(num_rise);
-	nregrm(den_fall);
-	nregrm(bar_wd);
-	nregrm(bar_dp);
-	nregrm(bar_ht);
-	nregrm(bar_fall);
-	nregrm(tmp_15d);
 }
 
 /* choose the smallest bracket among br[], large enough for \n(ht+\n(dp */
-static void box_bracketsel(int dst, int ht, int dp, char **br, int any, int both)
+static void box_bracketsel(int ht, int dp, char **br, int any, int both)
 {
 	int i;
 	for (i = 0; br[i]; i++) {
-		printf(".if '%s'' ", sreg(dst));
-		printf(".if \\w'%s' ", br[i]);	/* is this bracket available? */
-		if (both) {	/* check both the height and the depth */
-			printf(".if (%s-(%dm/100)*2)<=(-\\n[bbury]+\\n[bblly]+(%dm/100*2)) ",
-				nreg(ht), e_rulethickness, e_axisheight);
-			printf(".if (%s*2)<=(-\\n[bbury]+\\n[bblly]-(%dm/100*2)) ",
-				nreg(dp), e_axisheight);
-		} else {
-			printf(".if (%s+%s)<=(-\\n[bbury]+\\n[bblly]) ", nreg(ht), nreg(dp));
-		}
-		printf(".ds %s \"%s\n", sregname(dst), br[i]);
+		if (both)	/* check both the height and the depth */
+			out(".eqn.bs %s %s %d %d %s\n", nreg(ht), nreg(dp),
+				ctx->e_rulethickness, ctx->e_axisheight, br[i]);
+		else
+			out(".eqn.bt %s %s %s\n", nreg(ht), nreg(dp), br[i]);
 	}
 	if (any)		/* choose the largest bracket, if any is 1 */
 		while (--i >= 0)
-			printf(".if '%s'' .if \\w'%s' .ds %s \"%s\n",
-				sreg(dst), br[i], sregname(dst), br[i]);
-}
-
-/* build a bracket using the provided pieces */
-static void box_bracketmk(int dst, int len,
-			char *top, char *mid, char *bot, char *cen)
-{
-	int toplen[4];
-	int midlen[4];
-	int botlen[4];
-	int cenlen[4];
-	int mid_cnt = nregmk();	/* number of mid glyphs to insert */
-	int mid_cur = nregmk();	/* the number of mid glyphs inserted */
-	int cen_pos = nregmk();
-	int buildmacro = sregmk();
-	blen_mk(top, toplen);
-	blen_mk(mid, midlen);
-	blen_mk(bot, botlen);
-	if (cen)
-		blen_mk(cen, cenlen);
-	/* the number of mid tokens necessary to cover sub */
-	if (!cen) {
-		printf(".nr %s %s*2-%s-%s*11/10/%s\n",
-			nregname(mid_cnt), nreg(len),
-			nreg(toplen[1]), nreg(botlen[1]), nreg(midlen[1]));
-		printf(".if %s<0 .nr %s 0\n", nreg(mid_cnt), nregname(mid_cnt));
-	} else {	/* for brackets with a center like { */
-		printf(".nr %s %s-(%s+%s+%s/2)*11/10/%s\n",
-			nregname(cen_pos), nreg(len), nreg(cenlen[1]),
-			nreg(toplen[1]), nreg(botlen[1]), nreg(midlen[1]));
-		printf(".if %s<0 .nr %s 0\n", nreg(cen_pos), nregname(cen_pos));
-		printf(".nr %s 0%s*2\n", nregname(mid_cnt), nreg(cen_pos));
-	}
-	/* the macro to create the bracket; escaping backslashes */
-	printf(".de %s\n", sregname(buildmacro));
-	if (cen)		/* inserting cen */
-		printf(".if \\%s=\\%s .as %s \"\\v'-\\%su'%s\\h'-\\%su'\\v'-\\%su'\n",
-			nreg(mid_cur), nreg(cen_pos), sregname(dst),
-			nreg(cenlen[3]), cen, nreg(cenlen[0]), nreg(cenlen[2]));
-	printf(".if \\%s<\\%s .as %s \"\\v'-\\%su'%s\\h'-\\%su'\\v'-\\%su'\n",
-		nreg(mid_cur), nreg(mid_cnt),
-		sregname(dst), nreg(midlen[3]),
-		mid, nreg(midlen[0]), nreg(midlen[2]));
-	printf(".if \\\\n+%s<\\%s .%s\n",
-		escarg(nregname(mid_cur)), nreg(mid_cnt), sregname(buildmacro));
-	printf("..\n");
-	/* constructing the bracket */
-	printf(".ds %s \"\\v'-%su'%s\\h'-%su'\\v'-%su'\n",
-		sregname(dst), nreg(botlen[3]),
-		bot, nreg(botlen[0]), nreg(botlen[2]));
-	printf(".nr %s 0 1\n", nregname(mid_cur));
-	printf(".%s\n", sregname(buildmacro));
-	printf(".as %s \"\\v'-%su'%s\\h'-%su'\\v'-%su'\n",
-		sregname(dst), nreg(toplen[3]), top,
-		nreg(toplen[0]), nreg(toplen[2]));
-	/* moving back vertically */
-	printf(".as %s \"\\v'%su*%su+%su+%su+%su'\n",
-		sregname(dst), nreg(mid_cnt), nreg(midlen[1]), nreg(botlen[1]),
-		nreg(toplen[1]), cen ? nreg(cenlen[1]) : "0");
-	/* moving right */
-	printf(".as %s \"\\h'%su'\n",
-		sregname(dst), cen ? nreg(cenlen[0]) : nreg(midlen[0]));
-	blen_rm(toplen);
-	blen_rm(midlen);
-	blen_rm(botlen);
+			out(".eqn.ba %s\n", br[i]);
+}
+
+/* build a bracket of length len using the provided pieces */
+static void box_bracketmk(int len, char *top, char *mid, char *bot, char *cen)
+{
 	if (cen)
-		blen_rm(cenlen);
-	nregrm(mid_cnt);
-	nregrm(mid_cur);
-	nregrm(cen_pos);
-	sregrm(buildmacro);
+		out(".eqn.bc %s %s %s %s %s\n", nreg(len), top, mid, bot, cen);
+	else
+		out(".eqn.bm %s %s %s %s\n", nreg(len), top, mid, bot);
 }
 
 static void box_bracket(struct box *box, char *brac, int ht, int dp)
 {
 	char *sizes[NSIZES] = {NULL};
 	char *top = NULL, *mid = NULL, *bot = NULL, *cen = NULL;
-	int dst = sregmk();
 	int len = nregmk();
 	int fall = nregmk();
 	int parlen[4];
 	roff_max(len, ht, dp);
 	def_sizes(brac, sizes);
-	printf(".ds %s \"\n", sregname(dst));
+	out(".ds eqn.br \"\n");
 	def_pieces(brac, &top, &mid, &bot, &cen);
-	box_bracketsel(dst, ht, dp, sizes, !mid, 1);
+	box_bracketsel(ht, dp, sizes, !mid, 1);
 	if (mid) {
-		printf(".if '%s'' \\{\\\n", sreg(dst));
-		box_bracketmk(dst, len, top, mid, bot, cen);
-		printf(".  \\}\n");
+		out(".if '\\*[eqn.br]'' ");
+		box_bracketmk(len, top, mid, bot, cen);
 	}
 	/* calculating the total vertical length of the bracket */
-	blen_mk(sreg(dst), parlen);
+	blen_mk("\\*[eqn.br]", parlen);
 	/* calculating the amount the bracket should be moved downwards */
-	printf(".nr %s 0-%s+%s/2-(%sp*%du/100u)\n", nregname(fall),
-		nreg(parlen[3]), nreg(parlen[2]), nreg(box->szreg), e_axisheight);
+	out(".nr %s 0-%s+%s/2-(%sp*%du/100u)\n", nregname(fall),
+		nreg(parlen[3]), nreg(parlen[2]), nreg(box->szreg), ctx->e_axisheight);
 	/* printing the output */
-	box_putf(box, "\\f[\\n(.f]\\s[\\n(.s]\\v'%su'%s\\v'-%su'",
-		nreg(fall), sreg(dst), nreg(fall));
+	box_putf(box, "\\f[\\n(.f]\\s[\\n(.s]\\v'%su'\\*[eqn.br]\\v'-%su'",
+		nreg(fall), nreg(fall));
 	box_toreg(box);
 	blen_rm(parlen);
-	sregrm(dst);
 	nregrm(len);
 	nregrm(fall);
 }
@@ -655,7 +1042,7 @@ void box_wrap(struct box *box, struct box *sub, char *left, char *right)
 {
 	int sublen[4];
 	blen_mk(box_toreg(sub), sublen);
-	printf(".ps %s\n", nreg(box->szreg));
+	box_ps(box->szreg);
 	if (left) {
 		box_beforeput(box, T_LEFT, 0);
 		box_bracket(box, bracsign(left, 1), sublen[2], sublen[3]);
@@ -675,64 +1062,60 @@ static void sqrt_rad(int dst, int len, int wd)
 {
 	char *sizes[NSIZES] = {NULL};
 	int srlen[4];
-	int rnlen[4];
+	int *rnlen;
+	struct glyph *sr, *rn;
 	int sr_sz = nregmk();
 	int wd_diff = nregmk();		/* if wd is shorter than \(rn */
 	int sr_rx = nregmk();		/* the right-most horizontal position of \(sr */
 	int rn_dx = nregmk();		/* horizontal displacement necessary for \(rn */
 	int len2 = nregmk();
-	int rad = sregmk();
 	char *top = NULL, *mid = NULL, *bot = NULL, *cen;
-	printf(".nr %s 0%s/2*11/10\n", nregname(len2), nreg(len));
-	printf(".ds %s \"\n", sregname(rad));
+	out(".nr %s 0%s/2*11/10\n", nregname(len2), nreg(len));
+	out(".ds eqn.br \"\n");
 	/* selecting a radical of the appropriate size */
 	def_pieces("\\(sr", &top, &mid, &bot, &cen);
 	def_sizes("\\(sr", sizes);
-	box_bracketsel(rad, len2, len2, sizes, 0, 0);
+	box_bracketsel(len2, len2, sizes, 0, 0);
 	/* constructing the bracket if needed */
 	if (mid) {
-		printf(".if \\w'%s' ", mid);
-		printf(".if '%s'' \\{\\\n", sreg(rad));
-		box_bracketmk(rad, len2, top, mid, bot, NULL);
-		printf(".  \\}\n");
+		out(".if \\w'%s' .if '\\*[eqn.br]'' ", mid);
+		box_bracketmk(len2, top, mid, bot, NULL);
 	}
 	/* enlarging \(sr if no suitable glyph was found */
-	printf(".if '%s'' \\{\\\n", sreg(rad));
-	blen_mk("\\(sr", srlen);
-	printf(".ie %s<(%s+%s) .nr %s 0\\n(.s\n",
-		nreg(len), nreg(srlen[2]), nreg(srlen[3]), nregname(sr_sz));
-	printf(".el .nr %s 0%s*\\n(.s/(%s+%s-(%dm/100u))+1\n",
+	out(".if '\\*[eqn.br]'' \\{\\\n");
+	sr = glyph_len("\\(sr");
+	out(".ie %s<(%s+%s) .nr %s 0\\n(.s\n",
+		nreg(len), nreg(sr->len[2]), nreg(sr->len[3]), nregname(sr_sz));
+	out(".el .nr %s 0%s*\\n(.s/(%s+%s-(%dm/100u))+1\n",
 		nregname(sr_sz), nreg(len),
-		nreg(srlen[2]), nreg(srlen[3]), e_rulethickness);
-	printf(".ps %s\n", nreg(sr_sz));
-	printf(".ds %s \"\\(sr\n", sregname(rad));
-	blen_rm(srlen);
-	printf(".  \\}\n");
+		nreg(sr->len[2]), nreg(sr->len[3]), ctx->e_rulethickness);
+	box_ps(sr_sz);
+	out(".ds eqn.br \"\\(sr\n");
+	out(".  \\}\n");
 	/* adding the handle */
-	blen_mk(sreg(rad), srlen);
-	printf(".nr %s \\n[bburx]\n", nregname(sr_rx));
-	blen_mk("\\(rn", rnlen);
-	printf(".nr %s 0%s-\\n[bbllx]-(%dm/100u)\n",
-		nregname(rn_dx), nreg(sr_rx), e_rulethickness);
-	printf(".nr %s 0\n", nregname(wd_diff));
-	printf(".if %s<%s .nr %s 0%s-%s\n",
+	blen_mk("\\*[eqn.br]", srlen);
+	out(".nr %s \\n[bburx]\n", nregname(sr_rx));
+	rn = glyph_len("\\(rn");
+	rnlen = rn->len;
+	out(".nr %s 0%s-%s-(%dm/100u)\n",
+		nregname(rn_dx), nreg(sr_rx), nreg(rn->llx), ctx->e_rulethickness);
+	out(".nr %s 0\n", nregname(wd_diff));
+	out(".if %s<%s .nr %s 0%s-%s\n",
 		nreg(wd), nreg(rnlen[0]),
 		nregname(wd_diff), nreg(rnlen[0]), nreg(wd));
 	/* output the radical; align the top of the radical to the baseline */
-	printf(".ds %s \"\\s[\\n(.s]\\f[\\n(.f]"
+	out(".ds %s \"\\s[\\n(.s]\\f[\\n(.f]"
 		"\\v'%su'\\h'%su'\\l'%su+%su\\(rn'\\h'-%su'\\v'-%su'"
-		"\\h'-%su-%su'\\v'%su'%s\\v'-%su'\\h'%su+%su'\n",
+		"\\h'-%su-%su'\\v'%su'\\*[eqn.br]\\v'-%su'\\h'%su+%su'\n",
 		nregname(dst),
 		nreg(rnlen[2]), nreg(rn_dx), nreg(wd), nreg(wd_diff),
 		nreg(rn_dx), nreg(rnlen[2]), nreg(wd), nreg(wd_diff),
-		nreg(srlen[2]), sreg(rad), nreg(srlen[2]), nreg(wd), nreg(wd_diff));
+		nreg(srlen[2]), nreg(srlen[2]), nreg(wd), nreg(wd_diff));
 	blen_rm(srlen);
-	blen_rm(rnlen);
 	nregrm(sr_sz);
 	nregrm(wd_diff);
 	nregrm(sr_rx);
 	nregrm(rn_dx);
-	sregrm(rad);
 }
 
 void box_sqrt(struct box *box, struct box *sub)
@@ -745,23 +1128,23 @@ void box_sqrt(struct box *box, struct box *sub)
 	box_italiccorrection(sub);
 	box_beforeput(box, T_ORD, 0);
 	blen_mk(box_toreg(sub), sublen);
-	printf(".ps %s\n", nreg(box->szreg));
+	box_ps(box->szreg);
 	/* 11 */
-	printf(".nr %s 0%s+%s+(2*%dm/100u)+(%dm/100u/4)\n",
+	out(".nr %s 0%s+%s+(2*%dm/100u)+(%dm/100u/4)\n",
 		nregname(min_ht), nreg(sublen[2]), nreg(sublen[3]),
-		e_rulethickness,
-		TS_DX(box->style) ? e_xheight : e_rulethickness);
+		ctx->e_rulethickness,
+		TS_DX(box->style) ? ctx->e_xheight : ctx->e_rulethickness);
 	sqrt_rad(rad, min_ht, sublen[0]);
 	blen_mk(sreg(rad), radlen);
-	printf(".nr %s 0(%dm/100u)+(%dm/100u/4)\n",
-		nregname(rad_rise), e_rulethickness,
-		TS_DX(box->style) ? e_xheight : e_rulethickness);
-	printf(".if %s>(%s+%s+%s) .nr %s (%s+%s-%s-%s)/2\n",
+	out(".nr %s 0(%dm/100u)+(%dm/100u/4)\n",
+		nregname(rad_rise), ctx->e_rulethickness,
+		TS_DX(box->style) ? ctx->e_xheight : ctx->e_rulethickness);
+	out(".if %s>(%s+%s+%s) .nr %s (%s+%s-%s-%s)/2\n",
 		nreg(radlen[3]), nreg(sublen[2]), nreg(sublen[3]),
 		nreg(rad_rise), nregname(rad_rise),
 		nreg(rad_rise), nreg(radlen[3]), nreg(sublen[2]),
 		nreg(sublen[3]));
-	printf(".nr %s +%s\n", nregname(rad_rise), nreg(sublen[2]));
+	out(".nr %s +%s\n", nregname(rad_rise), nreg(sublen[2]));
 	/* output the radical */
 	box_putf(box, "\\v'-%su'%s\\v'%su'\\h'-%su'%s",
 		nreg(rad_rise), sreg(rad), nreg(rad_rise),
@@ -779,25 +1162,22 @@ void box_bar(struct box *box)
 {
 	int box_wd = nregmk();
 	int box_ht = nregmk();
-	int bar_wd = nregmk();
-	int bar_dp = nregmk();
+	int bar_dp;
 	int bar_rise = nregmk();
 	box_italiccorrection(box);
-	printf(".ps %s\n", nreg(box->szreg));
-	tok_len("\\(ru", bar_wd, 0, 0, bar_dp);
+	box_ps(box->szreg);
+	bar_dp = glyph_len("\\(ru")->len[3];
 	tok_dim(box_toreg(box), box_wd, box_ht, 0);
-	printf(".if %su<(%dm/100u) .nr %s 0%dm/100u\n",
-		nreg(box_ht), e_xheight, nregname(box_ht), e_xheight);
-	printf(".nr %s 0%su+%su+(3*%dm/100u)\n",
+	out(".if %su<(%dm/100u) .nr %s 0%dm/100u\n",
+		nreg(box_ht), ctx->e_xheight, nregname(box_ht), ctx->e_xheight);
+	out(".nr %s 0%su+%su+(3*%dm/100u)\n",
 		nregname(bar_rise), nreg(box_ht),
-		nreg(bar_dp), e_rulethickness);
+		nreg(bar_dp), ctx->e_rulethickness);
 	box_putf(box, "\\v'-%su'\\s%s\\f[\\n(.f]\\l'-%su\\(ru'\\v'%su'",
 		nreg(bar_rise), escarg(nreg(box->szreg)),
 		nreg(box_wd), nreg(bar_rise));
 	nregrm(box_wd);
 	nregrm(box_ht);
-	nregrm(bar_wd);
-	nregrm(bar_dp);
 	nregrm(bar_rise);
 }
 
@@ -806,15 +1186,17 @@ void box_accent(struct box *box, char *c)
 	int box_wd = nregmk();
 	int box_ht = nregmk();
 	int ac_rise = nregmk();
-	int ac_wd = nregmk();
-	int ac_dp = nregmk();
+	int ac_wd, ac_dp;
+	struct glyph *ac;
 	box_italiccorrection(box);
-	printf(".ps %s\n", nreg(box->szreg));
-	tok_len(c, ac_wd, 0, 0, ac_dp);
+	box_ps(box->szreg);
+	ac = glyph_len(c);
+	ac_wd = ac->len[0];
+	ac_dp = ac->len[3];
 	tok_dim(box_toreg(box), box_wd, box_ht, 0);
-	printf(".if %su<(%dm/100u) .nr %s 0%dm/100u\n",
-		nreg(box_ht), e_xheight, nregname(box_ht), e_xheight);
-	printf(".nr %s 0%su+%su+(%sp*10u/100u)\n",
+	out(".if %su<(%dm/100u) .nr %s 0%dm/100u\n",
+		nreg(box_ht), ctx->e_xheight, nregname(box_ht), ctx->e_xheight);
+	out(".nr %s 0%su+%su+(%sp*10u/100u)\n",
 		nregname(ac_rise), nreg(box_ht),
 		nreg(ac_dp), nreg(box->szreg));
 	box_putf(box, "\\v'-%su'\\h'-%su-%su/2u'\\s%s\\f[\\n(.f]%s\\h'%su-%su/2u'\\v'%su'",
@@ -824,32 +1206,27 @@ void box_accent(struct box *box, char *c)
 	nregrm(box_wd);
 	nregrm(box_ht);
 	nregrm(ac_rise);
-	nregrm(ac_wd);
-	nregrm(ac_dp);
 }
 
 void box_under(struct box *box)
 {
 	int box_wd = nregmk();
 	int box_dp = nregmk();
-	int bar_wd = nregmk();
-	int bar_ht = nregmk();
+	int bar_ht;
 	int bar_fall = nregmk();
 	box_italiccorrection(box);
-	printf(".ps %s\n", nreg(box->szreg));
-	tok_len("\\(ul", bar_wd, 0, bar_ht, 0);
+	box_ps(box->szreg);
+	bar_ht = glyph_len("\\(ul")->len[2];
 	tok_dim(box_toreg(box), box_wd, 0, box_dp);
-	printf(".if %s<0 .nr %s 0\n", nreg(box_dp), nregname(box_dp));
-	printf(".nr %s 0%su+%su+(3*%dm/100u)\n",
+	out(".if %s<0 .nr %s 0\n", nreg(box_dp), nregname(box_dp));
+	out(".nr %s 0%su+%su+(3*%dm/100u)\n",
 		nregname(bar_fall), nreg(box_dp),
-		nreg(bar_ht), e_rulethickness);
+		nreg(bar_ht), ctx->e_rulethickness);
 	box_putf(box, "\\v'%su'\\s%s\\f[\\n(.f]\\l'-%su\\(ul'\\v'-%su'",
 		nreg(bar_fall), escarg(nreg(box->szreg)),
 		nreg(box_wd), nreg(bar_fall));
 	nregrm(box_wd);
 	nregrm(box_dp);
-	nregrm(bar_wd);
-	nregrm(bar_ht);
 	nregrm(bar_fall);
 }
 
@@ -857,33 +1234,30 @@ char *box_toreg(struct box *box)
 {
 	if (!box->reg) {
 		box->reg = sregmk();
-		printf(".ds %s \"%s\n", sregname(box->reg), box_buf(box));
+		box_defer(box, 0, 1);
 	}
 	return sreg(box->reg);
 }
 
 int box_empty(struct box *box)
 {
-	return !strlen(box_buf(box));
+	return !box->wlen && !strlen(box_buf(box));
 }
 
 void box_vcenter(struct box *box, struct box *sub)
 {
-	int wd = nregmk();
-	int ht = nregmk();
-	int dp = nregmk();
+	int ht, dp;
 	int fall = nregmk();
 	box_beforeput(box, sub->tbeg, 0);
-	tok_dim(box_toreg(sub), wd, ht, dp);
-	printf(".nr %s 0-%s+%s/2-(%sp*%du/100u)\n", nregname(fall),
-		nreg(dp), nreg(ht), nreg(box->szreg), e_axisheight);
+	box_dim(sub, 1, 1);
+	ht = sub->dim[1];
+	dp = sub->dim[2];
+	out(".nr %s 0-%s+%s/2-(%sp*%du/100u)\n", nregname(fall),
+		nreg(dp), nreg(ht), nreg(box->szreg), ctx->e_axisheight);
 	box_putf(box, "\\v'%su'%s\\v'-%su'",
 		nreg(fall), box_toreg(sub), nreg(fall));
 	box_toreg(box);
 	box_afterput(box, sub->tcur);
-	nregrm(wd);
-	nregrm(ht);
-	nregrm(dp);
 	nregrm(fall);
 }
 
@@ -895,18 +1269,19 @@ void box_vertspace(struct box *box)
 	int dproom = nregmk();
 	box_italiccorrection(box);
 	/* amount of room available before and after this line */
-	printf(".nr %s 0+\\n(.vu-%sp+(%sp*%du/100u)\n",
+	out(".nr %s 0+\\n(.vu-%sp+(%sp*%du/100u)\n",
 		nregname(htroom), nreg(box->szreg),
-		nreg(box->szreg), e_bodyheight);
-	printf(".nr %s 0+\\n(.vu-%sp+(%sp*%du/100u)\n",
+		nreg(box->szreg), ctx->e_bodyheight);
+	out(".nr %s 0+\\n(.vu-%sp+(%sp*%du/100u)\n",
 		nregname(dproom), nreg(box->szreg),
-		nreg(box->szreg), e_bodydepth);
+		nreg(box->szreg), ctx->e_bodydepth);
 	/* appending \x requests */
 	tok_dim(box_toreg(box), box_wd, 0, 0);
-	printf(".if -\\n[bbury]>%s .as %s \"\\x'\\n[bbury]u+%su'\n",
+	out(".if -\\n[bbury]>%s .as %s \"\\x'\\n[bbury]u+%su'\n",
 		nreg(htroom), sregname(box->reg), nreg(htroom));
-	printf(".if \\n[bblly]>%s .as %s \"\\x'\\n[bblly]u-%su'\n",
+	out(".if \\n[bblly]>%s .as %s \"\\x'\\n[bblly]u-%su'\n",
 		nreg(dproom), sregname(box->reg), nreg(dproom));
+	box->dimok = 0;
 	nregrm(box_wd);
 	nregrm(htroom);
 	nregrm(dproom);
@@ -928,22 +1303,22 @@ static void box_colinit(struct box **pile, int n,
 			box_italiccorrection(pile[i]);
 	for (i = 0; i < n; i++)
 		blen_mk(pile[i] ? box_toreg(pile[i]) : "", plen[i]);
-	printf(".nr %s 0%s\n", nregname(wd), nreg(plen[0][0]));
-	printf(".nr %s 0%s\n", nregname(ht), nreg(plen[0][2]));
+	out(".nr %s 0%s\n", nregname(wd), nreg(plen[0][0]));
+	out(".nr %s 0%s\n", nregname(ht), nreg(plen[0][2]));
 	/* finding the maximum width */
 	for (i = 1; i < n; i++) {
-		printf(".if %s>%s .nr %s 0+%s\n",
+		out(".if %s>%s .nr %s 0+%s\n",
 			nreg(plen[i][0]), nreg(wd),
 			nregname(wd), nreg(plen[i][0]));
 	}
 	/* finding the maximum height (vertical length) */
 	for (i = 1; i < n; i++) {
-		printf(".if %s+%s>%s .nr %s 0+%s+%s\n",
+		out(".if %s+%s>%s .nr %s 0+%s+%s\n",
 			nreg(plen[i - 1][3]), nreg(plen[i][2]), nreg(ht),
 			nregname(ht), nreg(plen[i - 1][3]), nreg(plen[i][2]));
 	}
 	/* maximum height and the depth of the last row */
-	printf(".if %s>%s .nr %s 0+%s\n",
+	out(".if %s>%s .nr %s 0+%s\n",
 		nreg(plen[n - 1][3]), nreg(ht),
 		nregname(ht), nreg(plen[n - 1][3]));
 }
@@ -965,12 +1340,12 @@ static void box_colput(struct box **pile, int n, struct box *box,
 		box_putf(box, "\\v'%su'%s", i ? nreg(ht) : "0",
 			pile[i] ? box_toreg(pile[i]) : "");
 		if (adj == 'l')
-			box_putf(box, "\\h'-%su'", nreg(plen[i][0]));
+			box_putmove(box, 'h', "-", nreg(plen[i][0]));
 		if (adj == 'c')
 			box_putf(box, "\\h'-%su+(%su-%su/2u)'",
 				nreg(wd), nreg(wd), nreg(plen[i][0]));
 		if (adj == 'r')
-			box_putf(box, "\\h'-%su'", nreg(wd));
+			box_putmove(box, 'h', "-", nreg(wd));
 	}
 	box_putf(box, "\\v'-%du*%su/2u'\\h'%su'", n - 1, nreg(ht), nreg(wd));
 }
@@ -1001,11 +1376,11 @@ void box_pile(struct box *box, struct box **pile, int adj, int rowspace)
 	box_beforeput(box, T_INNER, 0);
 	box_colinit(pile, n, plen, max_wd, max_ht);
 	/* inserting spaces between entries */
-	printf(".if %s<(%sp*%du/100u) .nr %s (%sp*%du/100u)\n",
-		nreg(max_ht), nreg(box->szreg), e_baselinesep,
-		nregname(max_ht), nreg(box->szreg), e_baselinesep);
+	out(".if %s<(%sp*%du/100u) .nr %s (%sp*%du/100u)\n",
+		nreg(max_ht), nreg(box->szreg), ctx->e_baselinesep,
+		nregname(max_ht), nreg(box->szreg), ctx->e_baselinesep);
 	if (rowspace)
-		printf(".nr %s +(%sp*%du/100u)\n",
+		out(".nr %s +(%sp*%du/100u)\n",
 			nregname(max_ht), nreg(box->szreg), rowspace);
 	/* adding the entries */
 	box_colput(pile, n, box, adj, plen, max_wd, max_ht);
@@ -1038,30 +1413,30 @@ void box_matrix(struct box *box, int ncols, struct box *cols[][NPILES],
 	for (i = 0; i < ncols; i++)
 		box_colinit(cols[i], nrows, plen[i], wd[i], ht[i]);
 	/* finding the maximum width and height */
-	printf(".nr %s 0%s\n", nregname(max_wd), nreg(wd[0]));
-	printf(".nr %s 0%s\n", nregname(max_ht), nreg(ht[0]));
+	out(".nr %s 0%s\n", nregname(max_wd), nreg(wd[0]));
+	out(".nr %s 0%s\n", nregname(max_ht), nreg(ht[0]));
 	for (i = 1; i < ncols; i++) {
-		printf(".if %s>%s .nr %s 0+%s\n",
+		out(".if %s>%s .nr %s 0+%s\n",
 			nreg(wd[i]), nreg(max_wd),
 			nregname(max_wd), nreg(wd[i]));
 	}
 	for (i = 1; i < ncols; i++) {
-		printf(".if %s>%s .nr %s 0+%s\n",
+		out(".if %s>%s .nr %s 0+%s\n",
 			nreg(ht[i]), nreg(max_ht),
 			nregname(max_ht), nreg(ht[i]));
 	}
 	/* inserting spaces between rows */
-	printf(".if %s<(%sp*%du/100u) .nr %s (%sp*%du/100u)\n",
-		nreg(max_ht), nreg(box->szreg), e_baselinesep,
-		nregname(max_ht), nreg(box->szreg), e_baselinesep);
+	out(".if %s<(%sp*%du/100u) .nr %s (%sp*%du/100u)\n",
+		nreg(max_ht), nreg(box->szreg), ctx->e_baselinesep,
+		nregname(max_ht), nreg(box->szreg), ctx->e_baselinesep);
 	if (rowspace)
-		printf(".nr %s +(%sp*%du/100u)\n",
+		out(".nr %s +(%sp*%du/100u)\n",
 			nregname(max_ht), nreg(box->szreg), rowspace);
 	/* printing the columns */
 	for (i = 0; i < ncols; i++) {
 		if (i)		/* space between columns */
 			box_putf(box, "\\h'%sp*%du/100u'",
-				nreg(box->szreg), e_columnsep + colspace);
+				nreg(box->szreg), ctx->e_columnsep + colspace);
 		box_colput(cols[i], nrows, box, adj[i],
 				plen[i], max_wd, max_ht);
 	}
@@ -1076,3 +1451,17 @@ void box_matrix(struct box *box, int ncols, struct box *cols[][NPILES],
 	nregrm(max_wd);
 	nregrm(max_ht);
 }
+
+void box_init(void)
+{
+	ctx->box_env = 1;
+	ctx->box_peepon = 1;
+	ctx->glyphs = calloc(NGLYPHS, sizeof(ctx->glyphs[0]));
+	sbuf_init(&ctx->box_text);
+}
+
+void box_done(void)
+{
+	free(ctx->glyphs);
+	sbuf_done(&ctx->box_text);
+}
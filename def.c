@@ -1,7 +1,14 @@
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "eqn.h"
 
+#define NGTYPES		128	/* the number of custom glyph types */
+
 /* null-terminated list of default macros */
 char *def_macros[][2] = {
 	{"<-",		"\\(<-"},
@@ -149,7 +156,7 @@ static char *bracketleft[] = {"(", "[", "{", "\\(lc", "\\(lf", "\\(la"};
 static char *bracketright[] = {")", "]", "}", "\\(rc", "\\(rf", "\\(ra"};
 
 /* glyphs for different bracket sizes */
-static char bracketsizes[32][NSIZES][BRLEN] = {
+static char bracketsizes_def[32][NSIZES][BRLEN] = {
 	{"(", "(", "\\N'parenleftbig'", "\\N'parenleftBig'",
 	 "\\N'parenleftbigg'", "\\N'parenleftBigg'"},
 	{")", ")", "\\N'parenrightbig'", "\\N'parenrightBig'",
@@ -180,7 +187,7 @@ static char bracketsizes[32][NSIZES][BRLEN] = {
 };
 
 /* large glyph pieces: name, top, mid, bot, centre */
-static char bracketpieces[32][8][BRLEN] = {
+static char bracketpieces_def[32][8][BRLEN] = {
 	{"(", "\\(LT", "\\(LX", "\\(LB"},
 	{")", "\\(RT", "\\(RX", "\\(RB"},
 	{"[", "\\(lc", "\\(lx", "\\(lf"},
@@ -196,23 +203,31 @@ static char bracketpieces[32][8][BRLEN] = {
 };
 
 /* custom glyph types */
-static struct gtype {
+struct gtype {
 	char g[GNLEN];
 	int type;
-} gtypes[128];
+};
 
 void def_typeput(char *s, int type)
 {
 	int i;
-	for (i = 0; i < LEN(gtypes) && gtypes[i].g[0]; i++)
-		if (!strcmp(s, gtypes[i].g))
+	for (i = 0; i < NGTYPES && ctx->gtypes[i].g[0]; i++)
+		if (!strcmp(s, ctx->gtypes[i].g))
 			break;
-	if (i < LEN(gtypes)) {
-		strcpy(gtypes[i].g, s);
-		gtypes[i].type = type;
+	if (i < NGTYPES) {
+		strcpy(ctx->gtypes[i].g, s);
+		ctx->gtypes[i].type = type;
+		ctx->gtypes_gen++;
+		ctx->def_ctab[(unsigned char) s[0]] |= C_TYPED;
 	}
 }
 
+/* the results of def_type() may change when this value changes */
+int def_typegen(void)
+{
+	return ctx->gtypes_gen;
+}
+
 /* find an entry in an array */
 static char *alookup(char **a, int len, char *s)
 {
@@ -226,9 +241,9 @@ static char *alookup(char **a, int len, char *s)
 int def_type(char *s)
 {
 	int i;
-	for (i = 0; i < LEN(gtypes) && gtypes[i].g[0]; i++)
-		if (!strcmp(s, gtypes[i].g))
-			return gtypes[i].type;
+	for (i = 0; i < NGTYPES && ctx->gtypes[i].g[0]; i++)
+		if (!strcmp(s, ctx->gtypes[i].g))
+			return ctx->gtypes[i].type;
 	if (alookup(puncs, LEN(puncs), s))
 		return T_PUNC;
 	if (alookup(binops, LEN(binops), s))
@@ -245,8 +260,8 @@ int def_type(char *s)
 static int pieces_find(char *sign)
 {
 	int i;
-	for (i = 0; i < LEN(bracketpieces); i++)
-		if (!strcmp(bracketpieces[i][0], sign))
+	for (i = 0; i < LEN(ctx->bracketpieces); i++)
+		if (!strcmp(ctx->bracketpieces[i][0], sign))
 			return i;
 	return -1;
 }
@@ -256,30 +271,32 @@ void def_pieces(char *sign, char **top, char **mid, char **bot, char **cen)
 {
 	int i = pieces_find(sign);
 	if (i >= 0) {
-		*top = bracketpieces[i][1][0] ? bracketpieces[i][1] : NULL;
-		*mid = bracketpieces[i][2][0] ? bracketpieces[i][2] : NULL;
-		*bot = bracketpieces[i][3][0] ? bracketpieces[i][3] : NULL;
-		*cen = bracketpieces[i][4][0] ? bracketpieces[i][4] : NULL;
+		*top = ctx->bracketpieces[i][1][0] ? ctx->bracketpieces[i][1] : NULL;
+		*mid = ctx->bracketpieces[i][2][0] ? ctx->bracketpieces[i][2] : NULL;
+		*bot = ctx->bracketpieces[i][3][0] ? ctx->bracketpieces[i][3] : NULL;
+		*cen = ctx->bracketpieces[i][4][0] ? ctx->bracketpieces[i][4] : NULL;
 	}
 }
 
 void def_piecesput(char *sign, char *top, char *mid, char *bot, char *cen)
 {
+	char (*p)[BRLEN];
 	int i = pieces_find(sign);
 	if (i < 0 && (i = pieces_find("")) < 0)
 		return;
-	snprintf(bracketpieces[i][0], sizeof(bracketpieces[i][0]), "%s", sign);
-	snprintf(bracketpieces[i][1], sizeof(bracketpieces[i][1]), "%s", top);
-	snprintf(bracketpieces[i][2], sizeof(bracketpieces[i][2]), "%s", mid);
-	snprintf(bracketpieces[i][3], sizeof(bracketpieces[i][3]), "%s", bot);
-	snprintf(bracketpieces[i][4], sizeof(bracketpieces[i][4]), "%s", cen);
+	p = ctx->bracketpieces[i];
+	snprintf(p[0], sizeof(p[0]), "%s", sign);
+	snprintf(p[1], sizeof(p[1]), "%s", top);
+	snprintf(p[2], sizeof(p[2]), "%s", mid);
+	snprintf(p[3], sizeof(p[3]), "%s", bot);
+	snprintf(p[4], sizeof(p[4]), "%s", cen);
 }
 
 static int sizes_find(char *sign)
 {
 	int i;
-	for (i = 0; i < LEN(bracketsizes); i++)
-		if (!strcmp(bracketsizes[i][0], sign))
+	for (i = 0; i < LEN(ctx->bracketsizes); i++)
+		if (!strcmp(ctx->bracketsizes[i][0], sign))
 			return i;
 	return -1;
 }
@@ -290,88 +307,61 @@ void def_sizes(char *sign, char *sizes[])
 	int idx = sizes_find(sign);
 	int i;
 	sizes[0] = sign;
-	for (i = 1; idx >= 0 && i < NSIZES; i++)
-		sizes[i - 1] = bracketsizes[idx][i][0] ? bracketsizes[idx][i] : NULL;
+	for (i = 1; idx >= 0 && i < NSIZES; i++) {
+		char *s = ctx->bracketsizes[idx][i];
+		sizes[i - 1] = s[0] ? s : NULL;
+	}
 }
 
 void def_sizesput(char *sign, char *sizes[])
 {
+	char (*p)[BRLEN];
 	int idx = sizes_find(sign);
 	int i;
 	if (idx < 0 && (idx = sizes_find("")) < 0)
 		return;
-	snprintf(bracketsizes[idx][0], sizeof(bracketsizes[idx][0]), "%s", sign);
+	p = ctx->bracketsizes[idx];
+	snprintf(p[0], sizeof(p[0]), "%s", sign);
 	for (i = 1; i < NSIZES; i++)
-		snprintf(bracketsizes[idx][i], sizeof(bracketsizes[idx][i]),
-			"%s", sizes[i - 1] ? sizes[i - 1] : "");
+		snprintf(p[i], sizeof(p[i]), "%s", sizes[i - 1] ? sizes[i - 1] : "");
 }
 
-/* global variables */
-int e_axisheight = 23;	/* axis height */
-int e_minimumsize = 5;	/* minimum size */
-int e_overhang = 7;
-int e_nulldelim = 12;
-int e_scriptspace = 12;
-int e_thinspace = 17;
-int e_mediumspace = 22;
-int e_thickspace = 28;
-int e_num1 = 70;	/* minimum numerator rise */
-int e_num2 = 40;
-int e_denom1 = 70;	/* minimum denominator fall */
-int e_denom2 = 36;
-int e_sup1 = 42;
-int e_sup2 = 37;
-int e_sup3 = 28;
-int e_sub1 = 20;
-int e_sub2 = 23;
-int e_supdrop = 38;
-int e_subdrop = 5;
-int e_xheight = 45;
-int e_rulethickness = 4;
-int e_bigopspacing1 = 11;
-int e_bigopspacing2 = 17;
-int e_bigopspacing3 = 20;
-int e_bigopspacing4 = 60;
-int e_bigopspacing5 = 10;
-int e_columnsep = 100;
-int e_baselinesep = 140;
-int e_bodyheight = 70;
-int e_bodydepth = 25;
-
+/* global variables and their default values */
 static struct gvar {
 	char *name;
-	int *ref;
+	int off;		/* the offset of the variable in struct neateqn */
+	int val;
 } gvars[] = {
-	{"axis_height", &e_axisheight},
-	{"minimum_size", &e_minimumsize},
-	{"over_hang", &e_overhang},
-	{"null_delimiter_space", &e_nulldelim},
-	{"script_space", &e_scriptspace},
-	{"thin_space", &e_thinspace},
-	{"medium_space", &e_mediumspace},
-	{"thick_space", &e_thickspace},
-	{"num1", &e_num1},
-	{"num2", &e_num2},
-	{"denom1", &e_denom1},
-	{"denom2", &e_denom2},
-	{"sup1", &e_sup1},
-	{"sup2", &e_sup2},
-	{"sup3", &e_sup3},
-	{"sub1", &e_sub1},
-	{"sub2", &e_sub2},
-	{"sup_drop", &e_supdrop},
-	{"sub_drop", &e_subdrop},
-	{"x_height", &e_xheight},
-	{"default_rule_thickness", &e_rulethickness},
-	{"big_op_spacing1", &e_bigopspacing1},
-	{"big_op_spacing2", &e_bigopspacing2},
-	{"big_op_spacing3", &e_bigopspacing3},
-	{"big_op_spacing4", &e_bigopspacing4},
-	{"big_op_spacing5", &e_bigopspacing5},
-	{"column_sep", &e_columnsep},
-	{"baseline_sep", &e_baselinesep},
-	{"body_height", &e_bodyheight},
-	{"body_depth", &e_bodydepth},
+	{"axis_height", offsetof(struct neateqn, e_axisheight), 23},
+	{"minimum_size", offsetof(struct neateqn, e_minimumsize), 5},
+	{"over_hang", offsetof(struct neateqn, e_overhang), 7},
+	{"null_delimiter_space", offsetof(struct neateqn, e_nulldelim), 12},
+	{"script_space", offsetof(struct neateqn, e_scriptspace), 12},
+	{"thin_space", offsetof(struct neateqn, e_thinspace), 17},
+	{"medium_space", offsetof(struct neateqn, e_mediumspace), 22},
+	{"thick_space", offsetof(struct neateqn, e_thickspace), 28},
+	{"num1", offsetof(struct neateqn, e_num1), 70},
+	{"num2", offsetof(struct neateqn, e_num2), 40},
+	{"denom1", offsetof(struct neateqn, e_denom1), 70},
+	{"denom2", offsetof(struct neateqn, e_denom2), 36},
+	{"sup1", offsetof(struct neateqn, e_sup1), 42},
+	{"sup2", offsetof(struct neateqn, e_sup2), 37},
+	{"sup3", offsetof(struct neateqn, e_sup3), 28},
+	{"sub1", offsetof(struct neateqn, e_sub1), 20},
+	{"sub2", offsetof(struct neateqn, e_sub2), 23},
+	{"sup_drop", offsetof(struct neateqn, e_supdrop), 38},
+	{"sub_drop", offsetof(struct neateqn, e_subdrop), 5},
+	{"x_height", offsetof(struct neateqn, e_xheight), 45},
+	{"default_rule_thickness", offsetof(struct neateqn, e_rulethickness), 4},
+	{"big_op_spacing1", offsetof(struct neateqn, e_bigopspacing1), 11},
+	{"big_op_spacing2", offsetof(struct neateqn, e_bigopspacing2), 17},
+	{"big_op_spacing3", offsetof(struct neateqn, e_bigopspacing3), 20},
+	{"big_op_spacing4", offsetof(struct neateqn, e_bigopspacing4), 60},
+	{"big_op_spacing5", offsetof(struct neateqn, e_bigopspacing5), 10},
+	{"column_sep", offsetof(struct neateqn, e_columnsep), 100},
+	{"baseline_sep", offsetof(struct neateqn, e_baselinesep), 140},
+	{"body_height", offsetof(struct neateqn, e_bodyheight), 70},
+	{"body_depth", offsetof(struct neateqn, e_bodydepth), 25},
 };
 
 void def_set(char *name, int val)
@@ -379,7 +369,7 @@ void def_set(char *name, int val)
 	int i;
 	for (i = 0; i < LEN(gvars); i++)
 		if (!strcmp(gvars[i].name, name))
-			*gvars[i].ref = val;
+			*(int *) ((char *) ctx + gvars[i].off) = val;
 }
 
 /* superscript style */
@@ -417,16 +407,12 @@ int ts_denom(int style)
 }
 
 /* extra line-break cost */
-static int brcost_type[32];
-static int brcost_cost[32];
-static int brcost_n;
-
 int def_brcost(int type)
 {
 	int i;
-	for (i = 0; i < brcost_n; i++)
-		if (brcost_type[i] == type && brcost_cost[i] > 0)
-			return brcost_cost[i];
+	for (i = 0; i < ctx->brcost_n; i++)
+		if (ctx->brcost_type[i] == type && ctx->brcost_cost[i] > 0)
+			return ctx->brcost_cost[i];
 	return 100000;
 }
 
@@ -434,27 +420,78 @@ void def_brcostput(int type, int cost)
 {
 	int i;
 	if (type == 0)
-		brcost_n = 0;
-	for (i = 0; i < brcost_n; i++)
-		if (brcost_type[i] == type)
+		ctx->brcost_n = 0;
+	for (i = 0; i < ctx->brcost_n; i++)
+		if (ctx->brcost_type[i] == type)
 			break;
-	if (type <= 0 || i + (i >= brcost_n) >= LEN(brcost_type))
+	if (type <= 0 || i + (i >= ctx->brcost_n) >= LEN(ctx->brcost_type))
 		return;
-	brcost_type[i] = type;
-	brcost_cost[i] = cost;
-	if (i >= brcost_n)
-		brcost_n = i + 1;
+	ctx->brcost_type[i] = type;
+	ctx->brcost_cost[i] = cost;
+	if (i >= ctx->brcost_n)
+		ctx->brcost_n = i + 1;
 }
 
-/* at which characters equations are chopped */
-static char chopped[256] = "^~\"\t";
+/* set cls for the characters of s */
+static void def_ctabset(char *s, int cls)
+{
+	while (*s)
+		ctx->def_ctab[(unsigned char) *s++] |= cls;
+}
 
-int def_chopped(int c)
+/* set C_TYPED for the first characters of a[] */
+static void def_ctabtyped(char **a, int len)
 {
-	return strchr("\n {}", c) != NULL || strchr(chopped, c) != NULL;
+	int i;
+	for (i = 0; i < len; i++)
+		ctx->def_ctab[(unsigned char) a[i][0]] |= C_TYPED;
+}
+
+/* fill def_ctab[] */
+static void def_ctabfill(void)
+{
+	int i;
+	for (i = 0; i < LEN(ctx->def_ctab); i++) {
+		ctx->def_ctab[i] = 0;
+		if (isdigit(i))
+			ctx->def_ctab[i] |= C_DIGIT;
+		if (isspace(i))
+			ctx->def_ctab[i] |= C_SPACE;
+		if (ispunct(i))
+			ctx->def_ctab[i] |= C_PUNCT;
+	}
+	ctx->def_ctab[0] = C_CHOP | C_SOFTSEP;	/* like strchr() */
+	def_ctabset("\n {}", C_CHOP);
+	def_ctabset(ctx->chopped, C_CHOP);
+	def_ctabset(T_SOFTSEP, C_SOFTSEP);
+	def_ctabtyped(puncs, LEN(puncs));
+	def_ctabtyped(binops, LEN(binops));
+	def_ctabtyped(relops, LEN(relops));
+	def_ctabtyped(bracketleft, LEN(bracketleft));
+	def_ctabtyped(bracketright, LEN(bracketright));
+	for (i = 0; i < NGTYPES && ctx->gtypes[i].g[0]; i++)
+		ctx->def_ctab[(unsigned char) ctx->gtypes[i].g[0]] |= C_TYPED;
 }
 
 void def_choppedset(char *c)
 {
-	strcpy(chopped, c);
+	strcpy(ctx->chopped, c);
+	def_ctabfill();
+}
+
+void def_init(void)
+{
+	int i;
+	memcpy(ctx->bracketsizes, bracketsizes_def, sizeof(bracketsizes_def));
+	memcpy(ctx->bracketpieces, bracketpieces_def, sizeof(bracketpieces_def));
+	ctx->gtypes = calloc(NGTYPES, sizeof(ctx->gtypes[0]));
+	strcpy(ctx->chopped, "^~\"\t");
+	for (i = 0; i < LEN(gvars); i++)
+		*(int *) ((char *) ctx + gvars[i].off) = gvars[i].val;
+	def_ctabfill();
+}
+
+void def_done(void)
+{
+	free(ctx->gtypes);
 }
@@ -16,220 +16,102 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "eqn.h"
+#include "neateqn.h"
 
-/* flags passed to eqn_box() */
-#define EQN_TSMASK	0x00ffff	/* style mask */
-#define EQN_SUB		0x020000	/* this is a subscript */
-#define EQN_FROM	0x040000	/* this is a from block */
+static struct box *eqn_box(struct node *node, int style, struct box *pre,
+		int sz0, char *fn0);
 
-static char gfont[FNLEN] = "2";
-static char grfont[FNLEN] = "1";
-static char gbfont[FNLEN] = "3";
-static char gsize[FNLEN] = "\\n[" EQNSZ "]";
-static char eqn_lineup[128];	/* the lineup horizontal request */
-static int eqn_lineupreg;	/* the number register holding lineup width */
-static int eqn_mk;		/* the value of MK */
-
-static struct box *eqn_box(int flg, struct box *pre, int sz0, char *fn0);
-
-/* read equations until delim is read */
-static int eqn_boxuntil(struct box *box, int sz0, char *fn0, char *delim)
+/* make the boxes of list and merge them into box */
+static void eqn_list(struct box *box, struct node *list, int sz0, char *fn0)
 {
 	struct box *sub = NULL;
-	while (tok_get() && tok_jmp(delim)) {
-		if (!strcmp("}", tok_get()))
-			return 1;
-		sub = eqn_box(box->style, sub ? box : NULL, sz0, fn0);
+	struct node *node;
+	for (node = list->kid; node; node = node->next) {
+		sub = eqn_box(node, box->style, sub ? box : NULL, sz0, fn0);
 		box_merge(box, sub, 0);
 		box_free(sub);
 	}
-	return 0;
 }
 
 /* subscript size */
 static void sizesub(int dst, int src, int style, int src_style)
 {
+	char expr[RLEN + 16];
+	int sz;
 	if (TS_SZ(style) > TS_SZ(src_style)) {
-		printf(".nr %s %s*7/10\n", nregname(dst), nreg(src));
-		printf(".if %s<%d .nr %s %d\n",
-			nreg(dst), e_minimumsize,
-			nregname(dst), e_minimumsize);
+		sprintf(expr, "%s*7/10", nreg(src));
+		nregexpr(dst, expr);
+		if (nregget(dst, &sz) && sz < ctx->e_minimumsize)
+			nregset(dst, ctx->e_minimumsize);
+		if (!nregget(dst, &sz))
+			out(".if %s<%d .nr %s %d\n",
+				nreg(dst), ctx->e_minimumsize,
+				nregname(dst), ctx->e_minimumsize);
 	} else {
-		printf(".nr %s %s\n", nregname(dst), nreg(src));
+		nregexpr(dst, nreg(src));
 	}
 }
 
-static char *tok_quotes(char *s)
-{
-	if (s && s[0] == '"') {
-		s[strlen(s) - 1] = '\0';
-		return s + 1;
-	}
-	return s ? s : "";
-}
-
-static char *tok_improve(char *s)
-{
-	if (s && s[0] == '-' && s[1] == '\0')
-		return "\\(mi";
-	if (s && s[0] == '+' && s[1] == '\0')
-		return "\\(pl";
-	if (s && s[0] == '\'' && s[1] == '\0')
-		return "\\(fm";
-	return tok_quotes(s);
-}
-
-static void eqn_bracketsizes(void)
+/* perform eqn commands affecting the layout */
+static void eqn_command(struct node *cmd)
 {
+	char *args[NSIZES + 8] = {NULL};
 	char sign[BRLEN];
-	char bufs[NSIZES][BRLEN];
-	char *sizes[NSIZES] = {NULL};
-	int n, i;
-	snprintf(sign, sizeof(sign), "%s", tok_quotes(tok_poptext(1)));
-	n = atoi(tok_poptext(1));
-	for (i = 0; i < n; i++) {
-		char *size = tok_quotes(tok_poptext(1));
-		if (i < NSIZES) {
-			snprintf(bufs[i], sizeof(bufs[i]), "%s", size);
-			sizes[i] = bufs[i];
-		}
-	}
-	def_sizesput(sign, sizes);
-}
-
-static void eqn_bracketpieces(void)
-{
-	char sign[BRLEN], top[BRLEN], mid[BRLEN], bot[BRLEN], cen[BRLEN];
-	snprintf(sign, sizeof(sign), "%s", tok_quotes(tok_poptext(1)));
-	snprintf(top, sizeof(top), "%s", tok_quotes(tok_poptext(1)));
-	snprintf(mid, sizeof(mid), "%s", tok_quotes(tok_poptext(1)));
-	snprintf(bot, sizeof(bot), "%s", tok_quotes(tok_poptext(1)));
-	snprintf(cen, sizeof(cen), "%s", tok_quotes(tok_poptext(1)));
-	def_piecesput(sign, top, mid, bot, cen);
-}
-
-static int typenum(char *s)
-{
-	if (!strcmp("ord", s) || !strcmp("ordinary", s))
-		return T_ORD;
-	if (!strcmp("op", s) || !strcmp("operator", s))
-		return T_BIGOP;
-	if (!strcmp("bin", s) || !strcmp("binary", s))
-		return T_BINOP;
-	if (!strcmp("rel", s) || !strcmp("relation", s))
-		return T_RELOP;
-	if (!strcmp("open", s) || !strcmp("opening", s))
-		return T_LEFT;
-	if (!strcmp("close", s) || !strcmp("closing", s))
-		return T_RIGHT;
-	if (!strcmp("punct", s) || !strcmp("punctuation", s))
-		return T_PUNC;
-	if (!strcmp("inner", s))
-		return T_INNER;
-	return T_ORD;
-}
-
-/* read chartype command arguments and perform it */
-static void eqn_chartype(void)
-{
-	char gl[GNLEN], type[NMLEN];
-	snprintf(type, sizeof(type), "%s", tok_quotes(tok_poptext(1)));
-	snprintf(gl, sizeof(gl), "%s", tok_quotes(tok_poptext(1)));
-	if (typenum(type) >= 0)
-		def_typeput(gl, typenum(type));
-}
-
-/* read breakcost command arguments and perform it */
-static void eqn_breakcost(void)
-{
-	char tok[NMLEN];
-	int cost, type;
-	snprintf(tok, sizeof(tok), "%s", tok_quotes(tok_poptext(1)));
-	cost = atoi(tok_poptext(1));
-	type = !strcmp("any", tok) ? 0 : typenum(tok);
-	if (type >= 0)
-		def_brcostput(type, cost);
-}
-
-/* read general eqn commands */
-static int eqn_commands(void)
-{
-	char var[LNLEN];
 	char *sz;
-	if (!tok_jmp("delim")) {
-		tok_delim();
-		return 0;
-	}
-	if (!tok_jmp("define")) {
-		tok_macro();
-		return 0;
-	}
-	if (!tok_jmp("gfont")) {
-		strcpy(gfont, tok_quotes(tok_poptext(1)));
-		return 0;
-	}
-	if (!tok_jmp("grfont")) {
-		strcpy(grfont, tok_quotes(tok_poptext(1)));
-		return 0;
-	}
-	if (!tok_jmp("gbfont")) {
-		strcpy(gbfont, tok_quotes(tok_poptext(1)));
-		return 0;
-	}
-	if (!tok_jmp("gsize")) {
-		sz = tok_quotes(tok_poptext(1));
+	struct node *arg;
+	int n = 0;
+	for (arg = cmd->kid; arg && n < LEN(args) - 1; arg = arg->next)
+		args[n++] = arg->s;
+	snprintf(sign, sizeof(sign), "%s", args[0]);
+	switch (cmd->kwd) {
+	case K_GFONT:
+		snprintf(ctx->gfont, sizeof(ctx->gfont), "%s", args[0]);
+		break;
+	case K_GRFONT:
+		snprintf(ctx->grfont, sizeof(ctx->grfont), "%s", args[0]);
+		break;
+	case K_GBFONT:
+		snprintf(ctx->gbfont, sizeof(ctx->gbfont), "%s", args[0]);
+		break;
+	case K_GSIZE:
+		sz = args[0];
 		if (sz[0] == '-' || sz[0] == '+')
-			sprintf(gsize, "\\n%s%s", escarg(EQNSZ), sz);
+			snprintf(ctx->gsize, sizeof(ctx->gsize), "\\n%s%s",
+				escarg(EQNSZ), sz);
 		else
-			strcpy(gsize, sz);
-		return 0;
-	}
-	if (!tok_jmp("set")) {
-		strcpy(var, tok_poptext(1));
-		def_set(var, atoi(tok_poptext(1)));
-		return 0;
-	}
-	if (!tok_jmp("bracketsizes")) {
-		eqn_bracketsizes();
-		return 0;
+			snprintf(ctx->gsize, sizeof(ctx->gsize), "%s", sz);
+		break;
+	case K_SET:
+		def_set(args[0], atoi(args[1]));
+		break;
+	case K_BRACKETSIZES:
+		args[MIN(n, NSIZES + 1)] = NULL;
+		def_sizesput(sign, args + 1);
+		break;
+	case K_BRACKETPIECES:
+		def_piecesput(sign, args[1], args[2], args[3], args[4]);
+		break;
+	case K_BREAKCOST:
+		if (cmd->val >= 0)
+			def_brcostput(cmd->val, atoi(args[1]));
+		break;
 	}
-	if (!tok_jmp("bracketpieces")) {
-		eqn_bracketpieces();
-		return 0;
-	}
-	if (!tok_jmp("chartype")) {
-		eqn_chartype();
-		return 0;
-	}
-	if (!tok_jmp("breakcost")) {
-		eqn_breakcost();
-		return 0;
-	}
-	return 1;
 }
 
-/* read user-specified spaces */
-static int eqn_gaps(struct box *box, int szreg)
+/* insert user-specified spaces */
+static void eqn_gap(struct box *box, struct node *gap, int szreg)
 {
-	if (!tok_jmp("~")) {
-		box_puttext(box, T_GAP, "\\h'%du*%sp/100u'",
-				S_S3, nreg(szreg));
-		return 0;
-	}
-	if (!tok_jmp("^")) {
-		box_puttext(box, T_GAP, "\\h'%du*%sp/100u'",
-				S_S1, nreg(szreg));
-		return 0;
-	}
-	if (!tok_jmp("\t")) {
+	if (gap->kwd == K_TAB)
 		box_puttext(box, T_GAP, "\t");
-		return 0;
-	}
-	return 1;
+	else
+		box_puttext(box, T_GAP, "\\h'%du*%sp/100u'",
+				gap->kwd == K_GAP ? S_S3 : S_S1, nreg(szreg));
 }
 
 /* return the font of the given token type */
@@ -238,79 +120,48 @@ static char *tok_font(int tok, char *fn)
 	if (fn && fn[0])
 		return fn;
 	if (tok == T_LETTER || tok == T_STRING)
-		return gfont;
-	return grfont;
-}
-
-/* check the next token */
-static void tok_expect(char *s)
-{
-	if (tok_jmp(s)) {
-		fprintf(stderr, "neateqn: expected %s bot got %s\n",
-			s, tok_get());
-		exit(1);
-	}
+		return ctx->gfont;
+	return ctx->grfont;
 }
 
-/* read pile command */
-static void eqn_pile(struct box *box, int sz0, char *fn0, int adj)
+/* make a pile */
+static void eqn_pile(struct box *box, struct node *node, int sz0, char *fn0)
 {
 	struct box *pile[NPILES] = {NULL};
+	struct node *row;
 	int i;
 	int n = 0;
-	int rowspace = 0;
-	if (tok_jmp("{")) {
-		rowspace = atoi(tok_poptext(1));
-		tok_expect("{");
-	}
-	do {
+	for (row = node->kid; row; row = row->next) {
 		pile[n++] = box_alloc(sz0, 0, box->style);
-	} while (!eqn_boxuntil(pile[n - 1], sz0, fn0, "above"));
-	tok_expect("}");
-	box_pile(box, pile, adj, rowspace);
+		eqn_list(pile[n - 1], row, sz0, fn0);
+	}
+	box_pile(box, pile, node->kwd, node->val);
 	for (i = 0; i < n; i++)
 		box_free(pile[i]);
 }
 
-/* read matrix command */
-static void eqn_matrix(struct box *box, int sz0, char *fn0)
+/* make a matrix */
+static void eqn_matrix(struct box *box, struct node *node, int sz0, char *fn0)
 {
 	struct box *cols[NPILES][NPILES] = {{NULL}};
 	int adj[NPILES];
+	struct node *col, *row;
 	int nrows;
 	int ncols = 0;
-	int colspace = 0;
 	int rowspace = 0;
 	int i, j;
-	if (tok_jmp("{")) {
-		colspace = atoi(tok_poptext(1));
-		tok_expect("{");
-	}
-	while (1) {
-		if (!tok_jmp("col") || !tok_jmp("ccol"))
-			adj[ncols] = 'c';
-		else if (!tok_jmp("lcol"))
-			adj[ncols] = 'l';
-		else if (!tok_jmp("rcol"))
-			adj[ncols] = 'r';
-		else
-			break;
+	for (col = node->kid; col; col = col->next) {
+		adj[ncols] = col->kwd;
+		if (col->val > rowspace)
+			rowspace = col->val;
 		nrows = 0;
-		if (tok_jmp("{")) {
-			i = atoi(tok_poptext(1));
-			if (i > rowspace)
-				rowspace = i;
-			tok_expect("{");
-		}
-		do {
+		for (row = col->kid; row; row = row->next) {
 			cols[ncols][nrows++] = box_alloc(sz0, 0, box->style);
-		} while (!eqn_boxuntil(cols[ncols][nrows - 1],
-				sz0, fn0, "above"));
-		tok_expect("}");
+			eqn_list(cols[ncols][nrows - 1], row, sz0, fn0);
+		}
 		ncols++;
 	}
-	tok_expect("}");
-	box_matrix(box, ncols, cols, adj, colspace, rowspace);
+	box_matrix(box, ncols, cols, adj, node->val, rowspace);
 	for (i = 0; i < ncols; i++)
 		for (j = 0; j < NPILES; j++)
 			if (cols[i][j])
@@ -321,148 +172,159 @@ static void eqn_matrix(struct box *box, int sz0, char *fn0)
 static int italic(char *fn)
 {
 	return (!strcmp("I", fn) || !strcmp("2", fn) ||
-		gfont == fn || !strcmp(gfont, fn)) ? T_ITALIC : 0;
+		ctx->gfont == fn || !strcmp(ctx->gfont, fn)) ? T_ITALIC : 0;
 }
 
-/* read a box without fractions */
-static struct box *eqn_left(int flg, struct box *pre, int sz0, char *fn0)
+/* make the box of an N_LEFT node */
+static struct box *eqn_left(struct node *node, int style, struct box *pre,
+		int sz0, char *fn0)
 {
 	struct box *box = NULL;
 	struct box *sub_sub = NULL, *sub_sup = NULL;
 	struct box *sub_from = NULL, *sub_to = NULL;
 	struct box *sqrt, *inner;
-	char left[NMLEN] = "", right[NMLEN] = "";
+	struct node *k = node->kid;
+	struct node *atom;
 	char fn[FNLEN] = "";
 	int sz = sz0;
 	int subsz;
 	int dx = 0, dy = 0;
-	int style = EQN_TSMASK & flg;
 	if (fn0)
 		strcpy(fn, fn0);
-	while (!eqn_commands())
-		;
+	for (; k && k->type == N_CMD; k = k->next)
+		eqn_command(k);
 	box = box_alloc(sz, pre ? pre->tcur : 0, style);
-	if (!eqn_gaps(box, sz)) {
-		while (!eqn_gaps(box, sz))
-			;
+	if (k && k->type == N_GAP) {
+		for (; k; k = k->next)
+			eqn_gap(box, k, sz);
 		return box;
 	}
-	while (1) {
-		if (!tok_jmp("fat")) {
-		} else if (!tok_jmp("roman")) {
-			strcpy(fn, grfont);
-		} else if (!tok_jmp("italic")) {
-			strcpy(fn, gfont);
-		} else if (!tok_jmp("bold")) {
-			strcpy(fn, gbfont);
-		} else if (!tok_jmp("font")) {
-			strcpy(fn, tok_poptext(1));
-		} else if (!tok_jmp("size")) {
-			sz = box_size(box, tok_poptext(1));
-		} else if (!tok_jmp("fwd")) {
-			dx += atoi(tok_poptext(1));
-		} else if (!tok_jmp("back")) {
-			dx -= atoi(tok_poptext(1));
-		} else if (!tok_jmp("down")) {
-			dy += atoi(tok_poptext(1));
-		} else if (!tok_jmp("up")) {
-			dy -= atoi(tok_poptext(1));
-		} else {
+	for (; k && k->type >= N_FONT && k->type <= N_MOVE; k = k->next) {
+		if (k->type == N_SIZE) {
+			sz = box_size(box, k->s);
+			continue;
+		}
+		switch (k->kwd) {
+		case K_ROMAN:
+			strcpy(fn, ctx->grfont);
+			break;
+		case K_ITALIC:
+			strcpy(fn, ctx->gfont);
+			break;
+		case K_BOLD:
+			strcpy(fn, ctx->gbfont);
+			break;
+		case K_FONT:
+			snprintf(fn, sizeof(fn), "%s", k->s);
+			break;
+		case K_FWD:
+			dx += k->val;
+			break;
+		case K_BACK:
+			dx -= k->val;
+			break;
+		case K_DOWN:
+			dy += k->val;
+			break;
+		case K_UP:
+			dy -= k->val;
 			break;
 		}
 	}
-	if (!tok_jmp("sqrt")) {
-		sqrt = eqn_left(TS_MK0(style), NULL, sz, fn);
-		printf(".ft %s\n", grfont);
+	switch (k ? k->type : -1) {
+	case N_SQRT:
+		sqrt = eqn_left(k->kid, TS_MK0(style), NULL, sz, fn);
+		box_font(ctx->grfont);
 		box_sqrt(box, sqrt);
 		box_free(sqrt);
-	} else if (!tok_jmp("pile") || !tok_jmp("cpile")) {
-		eqn_pile(box, sz, fn, 'c');
-	} else if (!tok_jmp("lpile")) {
-		eqn_pile(box, sz, fn, 'l');
-	} else if (!tok_jmp("rpile")) {
-		eqn_pile(box, sz, fn, 'r');
-	} else if (!tok_jmp("matrix")) {
-		eqn_matrix(box, sz, fn);
-	} else if (!tok_jmp("vcenter")) {
-		inner = eqn_left(flg, pre, sz, fn);
+		break;
+	case N_PILE:
+		eqn_pile(box, k, sz, fn);
+		break;
+	case N_MATRIX:
+		eqn_matrix(box, k, sz, fn);
+		break;
+	case N_VCENTER:
+		inner = eqn_left(k->kid, style, pre, sz, fn);
 		box_vcenter(box, inner);
 		box_free(inner);
-	} else if (!tok_jmp("{")) {
-		eqn_boxuntil(box, sz, fn, "}");
-	} else if (!tok_jmp("left")) {
+		break;
+	case N_LIST:
+		eqn_list(box, k, sz, fn);
+		break;
+	case N_BRACKET:
 		inner = box_alloc(sz, 0, style);
-		snprintf(left, sizeof(left), "%s", tok_quotes(tok_poptext(0)));
-		eqn_boxuntil(inner, sz, fn, "right");
-		snprintf(right, sizeof(right), "%s", tok_quotes(tok_poptext(0)));
-		printf(".ft %s\n", grfont);
-		box_wrap(box, inner, left[0] ? left : NULL,
-				right[0] ? right : NULL);
+		eqn_list(inner, k->kid, sz, fn);
+		box_font(ctx->grfont);
+		box_wrap(box, inner, k->s[0] ? k->s : NULL,
+				k->t[0] ? k->t : NULL);
 		box_free(inner);
-	} else if (tok_get() && tok_type() != T_KEYWORD) {
+		break;
+	case N_ATOMS:
 		if (dx || dy)
 			box_move(box, dy, dx);
 		box_putf(box, "\\s%s", escarg(nreg(sz)));
-		do {
-			char *cfn = tok_font(tok_type(), fn);
-			int chops;
-			box_puttext(box, tok_type() | italic(cfn), "\\f%s%s",
-					escarg(cfn), tok_improve(tok_get()));
-			chops = tok_chops(0);
-			tok_pop();
-			if (chops)		/* what we read was a splitting */
-				break;
-		} while (!tok_chops(0));	/* the next token is splitting */
+		for (atom = k->kid; atom; atom = atom->next) {
+			char *cfn = tok_font(atom->kwd, fn);
+			box_puttext(box, atom->kwd | italic(cfn), "\\f%s%s",
+					escarg(cfn), atom->s);
+		}
 		if (dx || dy)
 			box_move(box, -dy, -dx);
-	}
-	while (tok_get()) {
-		if (!tok_jmp("dyad")) {
-			printf(".ft %s\n", grfont);
+		break;
+	}
+	if (k && k->type >= N_SQRT && k->type <= N_ATOMS)
+		k = k->next;
+	for (; k && k->type == N_ACCENT; k = k->next) {
+		box_font(ctx->grfont);
+		switch (k->kwd) {
+		case K_DYAD:
 			box_accent(box, "\\(ab");
-		} else if (!tok_jmp("bar")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_BAR:
 			box_bar(box);
-		} else if (!tok_jmp("under")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_UNDER:
 			box_under(box);
-		} else if (!tok_jmp("vec")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_VEC:
 			box_accent(box, "\\s[\\n(.s/2u]\\(->\\s0");
-		} else if (!tok_jmp("tilde")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_TILDE:
 			box_accent(box, "\\s[\\n(.s*3u/4u]\\(ap\\s0");
-		} else if (!tok_jmp("hat")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_HAT:
 			box_accent(box, "ˆ");
-		} else if (!tok_jmp("dot")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_DOT:
 			box_accent(box, ".");
-		} else if (!tok_jmp("dotdot")) {
-			printf(".ft %s\n", grfont);
+			break;
+		case K_DOTDOT:
 			box_accent(box, "..");
-		} else {
 			break;
 		}
 	}
 	subsz = nregmk();
-	if (!tok_jmp("sub")) {
+	if (k && k->type == N_SUB) {
 		sizesub(subsz, sz0, ts_sup(style), style);
-		sub_sub = eqn_left(ts_sup(style) | EQN_SUB, NULL, subsz, fn0);
+		sub_sub = eqn_left(k->kid, ts_sup(style), NULL, subsz, fn0);
+		k = k->next;
 	}
-	if ((sub_sub || !(flg & EQN_SUB)) && !tok_jmp("sup")) {
+	if (k && k->type == N_SUP) {
 		sizesub(subsz, sz0, ts_sub(style), style);
-		sub_sup = eqn_left(ts_sub(style), NULL, subsz, fn0);
+		sub_sup = eqn_left(k->kid, ts_sub(style), NULL, subsz, fn0);
+		k = k->next;
 	}
 	if (sub_sub || sub_sup)
 		box_sub(box, sub_sub, sub_sup);
-	if (!tok_jmp("from")) {
+	if (k && k->type == N_FROM) {
 		sizesub(subsz, sz0, ts_sub(style), style);
-		sub_from = eqn_left(ts_sub(style) | EQN_FROM, NULL, subsz, fn0);
+		sub_from = eqn_left(k->kid, ts_sub(style), NULL, subsz, fn0);
+		k = k->next;
 	}
-	if ((sub_from || !(flg & EQN_FROM)) && !tok_jmp("to")) {
+	if (k && k->type == N_TO) {
 		sizesub(subsz, sz0, ts_sup(style), style);
-		sub_to = eqn_left(ts_sup(style), NULL, subsz, fn0);
+		sub_to = eqn_left(k->kid, ts_sup(style), NULL, subsz, fn0);
 	}
 	if (sub_from || sub_to) {
 		inner = box_alloc(sz0, 0, style);
@@ -482,46 +344,46 @@ static struct box *eqn_left(int flg, struct box *pre, int sz0, char *fn0)
 	return box;
 }
 
-/* read a box */
-static struct box *eqn_box(int flg, struct box *pre, int sz0, char *fn0)
+/* make the box of an N_LEFT or N_OVER node */
+static struct box *eqn_box(struct node *node, int style, struct box *pre,
+		int sz0, char *fn0)
 {
 	struct box *box;
-	struct box *sub_num = NULL, *sub_den = NULL;
-	int style = flg & EQN_TSMASK;
-	box = eqn_left(flg, pre, sz0, fn0);
-	while (!tok_jmp("over")) {
-		sub_num = box;
-		sub_den = eqn_left(TS_MK0(style), NULL, sz0, fn0);
-		box = box_alloc(sz0, pre ? pre->tcur : 0, style);
-		printf(".ft %s\n", grfont);
-		box_over(box, sub_num, sub_den);
-		box_free(sub_num);
-		box_free(sub_den);
-	}
+	struct box *sub_num, *sub_den;
+	if (node->type != N_OVER)
+		return eqn_left(node, style, pre, sz0, fn0);
+	sub_num = eqn_box(node->kid, style, pre, sz0, fn0);
+	sub_den = eqn_left(node->kid->next, TS_MK0(style), NULL, sz0, fn0);
+	box = box_alloc(sz0, pre ? pre->tcur : 0, style);
+	box_font(ctx->grfont);
+	box_over(box, sub_num, sub_den);
+	box_free(sub_num);
+	box_free(sub_den);
 	return box;
 }
 
-/* read an equation, either inline or block */
-static struct box *eqn_read(int style)
+/* make the box of an equation, either inline or block */
+static struct box *eqn_read(struct node *eqn, int style)
 {
 	struct box *box, *sub;
+	struct node *node;
 	int szreg = nregmk();
-	printf(".nr %s %s\n", nregname(szreg), gsize);
+	nregexpr(szreg, ctx->gsize);
 	box = box_alloc(szreg, 0, style);
-	while (tok_get()) {
-		if (!tok_jmp("mark")) {
-			eqn_mk = !eqn_mk ? 1 : eqn_mk;
+	for (node = eqn->kid; node; node = node->next) {
+		if (node->type == N_MARK) {
+			ctx->eqn_mk = !ctx->eqn_mk ? 1 : ctx->eqn_mk;
 			box_markpos(box, EQNMK);
 			continue;
 		}
-		if (!tok_jmp("lineup")) {
-			eqn_mk = 2;
-			box_markpos(box, nregname(eqn_lineupreg));
-			sprintf(eqn_lineup, "\\h'\\n%su-%su'",
-				escarg(EQNMK), nreg(eqn_lineupreg));
+		if (node->type == N_LINEUP) {
+			ctx->eqn_mk = 2;
+			box_markpos(box, nregname(ctx->eqn_lineupreg));
+			sprintf(ctx->eqn_lineup, "\\h'\\n%su-%su'",
+				escarg(EQNMK), nreg(ctx->eqn_lineupreg));
 			continue;
 		}
-		sub = eqn_box(style, box, szreg, NULL);
+		sub = eqn_box(node, style, box, szreg, NULL);
 		box_merge(box, sub, 1);
 		box_free(sub);
 	}
@@ -530,51 +392,160 @@ static struct box *eqn_read(int style)
 	return box;
 }
 
+__thread struct neateqn *ctx;
+
+/* make eqn the instance of the calling thread; return the previous one */
+static struct neateqn *eqn_enter(struct neateqn *eqn)
+{
+	struct neateqn *old = ctx;
+	ctx = eqn;
+	return old;
+}
+
 void errdie(char *msg)
 {
-	fprintf(stderr, msg);
-	exit(1);
+	char *eqn = sbuf_buf(&ctx->eqn_out);	/* this equation so far */
+	int n = sbuf_len(&ctx->eqn_out);
+	sbuf_cut(&ctx->eqn_out, 0);
+	out_to(NULL);
+	out_mem(eqn, n);
+	out_flush();
+	fprintf(stderr, "%s", msg);
+	longjmp(ctx->err, 1);
 }
 
-int main(int argc, char **argv)
+/* convert the equations of the input */
+static void eqn_run(void)
 {
 	struct box *box;
+	struct node *eqn;
 	char eqnblk[128];
-	int i;
-	for (i = 1; i < argc; i++) {
-		if (argv[i][0] != '-' || !argv[i][1])
-			break;
-		if (argv[i][1] == 'c') {
-			def_choppedset(argv[i][2] ? argv[i] + 2 : argv[++i]);
-		} else {
-			printf("Usage: neateqn [options] <input >output\n\n");
-			printf("Options:\n");
-			printf("  -c chars  \tcharacters that chop equations\n");
-			return 1;
-		}
-	}
-	for (i = 0; def_macros[i][0]; i++)
-		src_define(def_macros[i][0], def_macros[i][1]);
+	int style;
+	ctx->box_predone = 0;
 	while (!tok_eqn()) {
+		if (ctx->eqn_flags & NEATEQN_LIVE)
+			out_to(&ctx->eqn_out);
+		box_prelude();
 		reg_reset();
-		eqn_mk = 0;
+		mem_reset();
+		ctx->eqn_mk = 0;
 		tok_pop();
-		printf(".nr %s \\n(.s\n", EQNSZ);
-		printf(".nr %s \\n(.f\n", EQNFN);
-		eqn_lineupreg = nregmk();
-		box = eqn_read(tok_inline() ? TS_T : TS_D);
-		printf(".nr MK %d\n", eqn_mk);
+		out(".nr %s \\n(.s\n", EQNSZ);
+		out(".nr %s \\n(.f\n", EQNFN);
+		ctx->eqn_lineupreg = nregmk();
+		style = tok_inline() ? TS_T : TS_D;
+		eqn = parse_eqn();
+		if (ctx->eqn_flags & NEATEQN_DUMP)
+			parse_dump(eqn, 0);
+		box = eqn_read(eqn, style);
+		out(".nr MK %d\n", ctx->eqn_mk);
 		if (!box_empty(box)) {
-			sprintf(eqnblk, "%s%s", eqn_lineup, box_toreg(box));
+			sprintf(eqnblk, "%s%s", ctx->eqn_lineup, box_toreg(box));
 			tok_eqnout(eqnblk);
-			printf(".ps \\n%s\n", escarg(EQNSZ));
-			printf(".ft \\n%s\n", escarg(EQNFN));
+			out(".ps \\n%s\n", escarg(EQNSZ));
+			out(".ft \\n%s\n", escarg(EQNFN));
 		}
-		printf(".lf %d\n", src_lineget());
-		eqn_lineup[0] = '\0';
-		nregrm(eqn_lineupreg);
+		out(".lf %d\n", src_lineget());
+		ctx->eqn_lineup[0] = '\0';
+		nregrm(ctx->eqn_lineupreg);
 		box_free(box);
+		if (ctx->eqn_flags & NEATEQN_STATS)
+			reg_stats(src_lineget());
+		out_to(NULL);
+		if (ctx->eqn_flags & NEATEQN_LIVE) {
+			live_out(sbuf_buf(&ctx->eqn_out));
+			sbuf_cut(&ctx->eqn_out, 0);
+		}
 	}
+	if ((ctx->eqn_flags & NEATEQN_STATS) && (ctx->eqn_flags & NEATEQN_LIVE))
+		live_stats();
+	out_flush();
+}
+
+static struct neateqn *eqn_alloc(char *chopped, int flags,
+		struct neateqn *base)
+{
+	struct neateqn *eqn = calloc(1, sizeof(*eqn));
+	struct neateqn *old = eqn_enter(eqn);
+	strcpy(eqn->gfont, "2");
+	strcpy(eqn->grfont, "1");
+	strcpy(eqn->gbfont, "3");
+	strcpy(eqn->gsize, "\\n[" EQNSZ "]");
+	eqn->eqn_flags = flags;
+	eqn->out_fd = 1;
+	sbuf_init(&eqn->eqn_out);
+	def_init();
+	box_init();
+	reg_init();
+	if (chopped)
+		def_choppedset(chopped);
+	if (flags & NEATEQN_NOPEEP)
+		box_peepset(0);
+	src_init(base);
+	eqn_enter(old);
+	return eqn;
+}
+
+/* create a neateqn instance; see neateqn.h */
+struct neateqn *neateqn_alloc(char *chopped, int flags)
+{
+	return eqn_alloc(chopped, flags, NULL);
+}
+
+/* create an instance like base, sharing its built-in definitions */
+struct neateqn *neateqn_share(struct neateqn *base)
+{
+	return eqn_alloc(base->chopped, base->eqn_flags, base);
+}
+
+void neateqn_free(struct neateqn *eqn)
+{
+	struct neateqn *old = eqn_enter(eqn);
 	src_done();
-	return 0;
+	tok_done();
+	def_done();
+	box_done();
+	reg_done();
+	live_done();
+	mem_done();
+	sbuf_done(&eqn->eqn_out);
+	eqn_enter(old);
+	free(eqn);
+}
+
+/* convert the input read from ifd and write it to ofd */
+int neateqn_run(struct neateqn *eqn, int ifd, int ofd)
+{
+	struct neateqn *old = eqn_enter(eqn);
+	int ret = 0;
+	if (!setjmp(eqn->err)) {
+		src_file(ifd);
+		out_dest(ofd, NULL);
+		eqn_run();
+	} else {
+		ret = -1;
+	}
+	eqn_enter(old);
+	return ret;
+}
+
+/* convert the len bytes at in; *out is allocated with malloc() */
+int neateqn_compile(struct neateqn *eqn, char *in, long len, char **out)
+{
+	struct neateqn *old = eqn_enter(eqn);
+	int ret = -1;
+	if (!setjmp(eqn->err)) {
+		sbuf_init(&eqn->eqn_doc);
+		src_input(in, len);
+		out_dest(-1, &eqn->eqn_doc);
+		eqn_run();
+		out_dest(-1, NULL);
+		ret = sbuf_len(&eqn->eqn_doc);
+		*out = sbuf_buf(&eqn->eqn_doc);
+	} else {
+		eqn->out_doc = NULL;
+		sbuf_done(&eqn->eqn_doc);
+	}
+	eqn_enter(old);
+	return ret;
 }
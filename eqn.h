@@ -1,20 +1,22 @@
 /*
  * NEATEQN MAIN HEADER
  *
- * In Neateqn equations are recursively decomposed into boxes.  eqn.c
- * reads the input and makes eqn boxes by calling appropriate functions
- * from box.c.
+ * In Neateqn equations are recursively decomposed into boxes.  parse.c
+ * reads the input into a tree of nodes and eqn.c makes eqn boxes by
+ * walking the tree and calling appropriate functions from box.c.
  */
 /* predefined array sizes */
 #define FNLEN		32	/* font name length */
 #define SZLEN		32	/* point size length */
 #define LNLEN		1000	/* line length */
 #define NMLEN		32	/* macro name length */
-#define RLEN		8	/* register name length */
+#define RLEN		16	/* register interpolation size; fits any int id */
 #define NPILES		32	/* number of piled items */
 #define NSIZES		8	/* number of bracket sizes */
 #define GNLEN		32	/* glyph name length */
 #define BRLEN		64	/* bracket definition length */
+#define OBUFSZ		(1 << 16)	/* output buffer size */
+#define LV_NREGS	4096	/* numeric register names tracked by live.c */
 
 /* registers used by neateqn */
 #define EQNSZ		".eqnsz"	/* register for surrounding point size */
@@ -52,17 +54,69 @@
 
 #define T_ITALIC	0x0100		/* atom with italic font */
 
+/* character classes in def_ctab[] */
+#define C_CHOP		0x01		/* chops equations */
+#define C_SOFTSEP	0x02		/* in T_SOFTSEP */
+#define C_DIGIT		0x04
+#define C_SPACE		0x08
+#define C_PUNCT		0x10
+#define C_TYPED		0x20		/* may start a token known to def_type() */
+
+#define T_SOFTSEP	("^~{}(),\"\n\t =:|.+-*/\\,()[]<>!")
+
+/* keyword identifiers returned by tok_kwd(); see kwds[] in tok.c */
+enum {
+	K_FWD, K_DOWN, K_BACK, K_UP,			/* box modifiers */
+	K_BOLD, K_ITALIC, K_ROMAN, K_FONT, K_FAT, K_SIZE,
+	K_BAR, K_DOT, K_DOTDOT, K_DYAD,			/* accents */
+	K_HAT, K_UNDER, K_VEC, K_TILDE,
+	K_SUB, K_SUP, K_FROM, K_TO, K_VCENTER,
+	K_LEFT, K_RIGHT, K_OVER, K_SQRT,
+	K_PILE, K_LPILE, K_CPILE, K_RPILE, K_ABOVE,
+	K_MATRIX, K_COL, K_CCOL, K_LCOL, K_RCOL,
+	K_MARK, K_LINEUP,
+	K_DELIM, K_DEFINE, K_GFONT, K_GRFONT, K_GBFONT,	/* commands */
+	K_GSIZE, K_SET, K_CHARTYPE,
+	K_BRACKETSIZES, K_BRACKETPIECES, K_BREAKCOST,
+	K_LBRACE, K_RBRACE, K_GAP, K_THIN, K_TAB,	/* { } ~ ^ and tab */
+};
+
 /* spaces in hundredths of em */
-#define S_S1		e_thinspace	/* thin space */
-#define S_S2		e_mediumspace	/* medium space */
-#define S_S3		e_thickspace	/* thick space */
+#define S_S1		ctx->e_thinspace	/* thin space */
+#define S_S2		ctx->e_mediumspace	/* medium space */
+#define S_S3		ctx->e_thickspace	/* thick space */
 
 /* small helper functions */
 void errdie(char *msg);
 
+struct neateqn;
+
+/* a compiled macro body has one of these for each of its positions */
+struct mtok {
+	int len;		/* token length in the body; zero if not compiled */
+	int toklen;		/* token text length; the text is a prefix of the body */
+	int type;		/* token type */
+	int typegen;		/* the value of def_typegen() when type was computed */
+	int wlen;		/* word length for keyword and macro probes or zero */
+	int kwd;		/* keyword index of the word or -1 */
+};
+
+/* an input position saved by src_mark() */
+struct spos {
+	void *src;		/* the input stream */
+	long pos;		/* position in its buffer */
+	int uncnt;		/* the number of pushed-back characters */
+	int gen;		/* invalid if changed before src_rewind() */
+};
+
 /* reading the source */
 int src_next(void);
 void src_back(int c);
+void src_mark(struct spos *pos);
+int src_rewind(struct spos *pos);
+struct mtok *src_mtok(char **s);
+long src_span(char **s);
+void src_skip(long n);
 void src_define(char *name, char *def);
 int src_expand(char *name, char **args);
 int src_macro(char *name);
@@ -70,6 +124,9 @@ int src_arg(int i);
 int src_top(void);
 int src_lineget(void);
 void src_lineset(int n);
+void src_file(int fd);
+void src_input(char *s, long n);
+void src_init(struct neateqn *base);
 void src_done(void);
 
 /* tokenizer */
@@ -78,18 +135,27 @@ void tok_eqnout(char *s);
 char *tok_get(void);
 char *tok_pop(void);
 char *tok_poptext(int sep);
-int tok_jmp(char *kwd);
+int tok_jmp(int kwd);
+int tok_kwd(void);
+char *tok_kwdname(int kwd);
 int tok_type(void);
 int tok_chops(int soft);
 void tok_delim(void);
 void tok_macro(void);
 int tok_inline(void);
+struct mtok *tok_compile(char *s);
+void tok_done(void);
 
 /* default definitions and operators */
 int def_type(char *s);
 void def_typeput(char *s, int type);
-int def_chopped(int c);
+int def_typegen(void);
 void def_choppedset(char *s);
+void def_init(void);
+void def_done(void);
+void def_set(char *name, int val);
+#define def_class(c)	(ctx->def_ctab[(c) & 0xff])
+#define def_chopped(c)	(def_class(c) & C_CHOP)
 void def_pieces(char *sign, char **top, char **mid, char **bot, char **cen);
 void def_sizes(char *sign, char *sizes[]);
 int def_brcost(int type);
@@ -103,18 +169,75 @@ struct sbuf {
 	char *s;		/* allocated buffer */
 	int sz;			/* buffer size */
 	int n;			/* length of the string stored in s */
+	int mem;		/* s is allocated with mem_alloc() */
 };
 
 void sbuf_init(struct sbuf *sbuf);
+void sbuf_initmem(struct sbuf *sbuf);
 void sbuf_done(struct sbuf *sbuf);
 char *sbuf_buf(struct sbuf *sbuf);
 void sbuf_add(struct sbuf *sbuf, int c);
 void sbuf_append(struct sbuf *sbuf, char *s);
+void sbuf_mem(struct sbuf *sbuf, char *s, int len);
+void sbuf_int(struct sbuf *sbuf, int n);
 void sbuf_printf(struct sbuf *sbuf, char *s, ...);
+void sbuf_vprintf(struct sbuf *sbuf, char *s, va_list ap);
 void sbuf_cut(struct sbuf *sbuf, int n);
 int sbuf_len(struct sbuf *sbuf);
 int sbuf_empty(struct sbuf *sbuf);
 
+/* buffered output */
+void out(char *s, ...);
+void out_append(char *s);
+void out_mem(char *s, long n);
+void out_add(int c);
+void out_int(int n);
+void out_to(struct sbuf *sb);
+void out_dest(int fd, struct sbuf *doc);
+void out_flush(void);
+void out_defer(void (*pend)(void));
+
+/* memory released after each equation */
+void *mem_alloc(long n);
+char *mem_str(char *s);
+void mem_reset(void);
+void mem_done(void);
+
+/* parse tree node types */
+enum {
+	N_EQN,			/* an equation; marks, lineups and boxes */
+	N_MARK, N_LINEUP,
+	N_OVER,			/* the numerator and the denominator */
+	N_LEFT,			/* a box without fractions; see parse_left() */
+	N_CMD,			/* an eqn command with N_TEXT arguments */
+	N_TEXT,
+	N_GAP,			/* ~, ^, or tab */
+	N_FONT, N_SIZE, N_MOVE,				/* box modifiers */
+	N_SQRT, N_PILE, N_MATRIX, N_COL, N_VCENTER,	/* box contents */
+	N_LIST,			/* the boxes of braces or pile rows */
+	N_BRACKET, N_ATOMS, N_ATOM,
+	N_ACCENT,
+	N_SUB, N_SUP, N_FROM, N_TO,			/* scripts */
+};
+
+/* parse tree nodes; allocated by mem_alloc() */
+struct node {
+	int type;		/* node type (N_*) */
+	int kwd;		/* keyword, token type, or column adjustment */
+	int val;		/* numeric argument */
+	char *s, *t;		/* text arguments */
+	struct node *kid;	/* the first child */
+	struct node *next;	/* the next sibling */
+};
+
+struct node *parse_eqn(void);
+void parse_dump(struct node *node, int depth);
+
+/* removing unused requests */
+void live_out(char *eqn);
+void live_stats(void);
+void live_done(void);
+
 /* tex styles */
 #define TS_D		0x00
 #define TS_D0		0x01
@@ -139,13 +262,21 @@ int ts_num(int style);
 
 /* equations */
 struct box {
-	struct sbuf raw;	/* the contents */
+	struct sbuf raw;	/* the contents not written to reg */
+	int wlen;		/* the length of the contents written to reg */
 	int szreg, szown;	/* number register holding box size */
 	int reg;		/* register holding the contents */
 	int atoms;		/* the number of atoms inserted */
 	int tbeg, tcur;		/* type of the first and the last atoms */
 	int style;		/* tex style (TS_*) */
 	char *tomark;		/* register for saving box width */
+	int dim[3];		/* registers caching width, height and depth */
+	int dimok;		/* valid dim[] entries as bits; see box_dim() */
+	int dimenv;		/* box_env when dim[] was measured */
+	int pbeg;		/* where box_peep() started tracking the state */
+	int pmov;		/* the motion at the end of raw or -1; see box_peep() */
+	char pfn[2][FNLEN];	/* current and previous fonts; empty if unknown */
+	char psz[2][FNLEN];	/* current and previous point sizes */
 };
 
 struct box *box_alloc(int szreg, int at_pre, int style);
@@ -167,12 +298,17 @@ void box_gap(struct box *box, int n);
 char *box_buf(struct box *box);
 char *box_toreg(struct box *box);
 void box_vertspace(struct box *box);
+void box_font(char *fn);
+void box_peepset(int on);
+void box_prelude(void);
 int box_empty(struct box *box);
 void box_markpos(struct box *box, char *regname);
 void box_vcenter(struct box *box, struct box *sub);
 void box_pile(struct box *box, struct box **pile, int adj, int rowspace);
 void box_matrix(struct box *box, int ncols, struct box *cols[][NPILES],
 		int *adj, int colspace, int rowspace);
+void box_init(void);
+void box_done(void);
 
 /* managing registers */
 char *escarg(char *arg);
@@ -180,41 +316,142 @@ int sregmk(void);
 void sregrm(int id);
 int nregmk(void);
 void nregrm(int id);
+int nregkeep(void);
 char *nreg(int id);
 char *sreg(int id);
 char *nregname(int id);
+void nregset(int id, int val);
+void nregexpr(int id, char *s);
+int nregget(int id, int *val);
+int nregver(int id);
 char *sregname(int id);
 void reg_reset(void);
+void reg_stats(int line);
+void reg_init(void);
+void reg_done(void);
 
-/* eqn global variables */
-extern int e_axisheight;
-extern int e_minimumsize;
-extern int e_overhang;
-extern int e_nulldelim;
-extern int e_scriptspace;
-extern int e_thinspace;
-extern int e_mediumspace;
-extern int e_thickspace;
-extern int e_num1;
-extern int e_num2;
-extern int e_denom1;
-extern int e_denom2;
-extern int e_sup1;
-extern int e_sup2;
-extern int e_sup3;
-extern int e_sub1;
-extern int e_sub2;
-extern int e_supdrop;
-extern int e_subdrop;
-extern int e_xheight;
-extern int e_rulethickness;
-extern int e_bigopspacing1;
-extern int e_bigopspacing2;
-extern int e_bigopspacing3;
-extern int e_bigopspacing4;
-extern int e_bigopspacing5;
-extern int e_columnsep;
-extern int e_baselinesep;
-extern int e_bodyheight;
-extern int e_bodydepth;
-void def_set(char *name, int val);
+/* the state of a neateqn instance; see neateqn.h */
+struct neateqn {
+	/* src.c: input streams and macros */
+	struct esrc *esrc;		/* the current input stream */
+	struct esrc *esrc_stdin;	/* the default input stream */
+	int lineno;			/* current line number */
+	int esrc_depth;			/* the length of esrc chain */
+	struct esrc *esrc_free;		/* popped esrc buffers for reuse */
+	int esrc_gen;			/* changes when saved positions become invalid */
+	int ifd;			/* the input file descriptor */
+	char *ibuf;			/* input buffer */
+	long ibuf_len;			/* number of bytes in ibuf */
+	long ibuf_pos;			/* current position in ibuf */
+	long ibuf_lnpos;		/* lines are counted up to this position */
+	int ibuf_map;			/* ibuf is memory-mapped */
+	int ibuf_ext;			/* ibuf is given by src_input() */
+	struct mtab *macros;		/* macros defined in the input */
+	struct mtab *defs;		/* built-in macros */
+	int defs_shared;		/* defs belongs to another instance */
+	/* tok.c: the tokenizer */
+	int tok_eqen;			/* non-zero if inside .EQ/.EN */
+	int tok_line;			/* inside inline eqn block */
+	int tok_part;			/* partial line with inline eqn blocks */
+	struct sbuf tok;		/* current token */
+	struct sbuf tok_prev;		/* previous token */
+	int tok_curtype;		/* type of current token */
+	int tok_curkwd;			/* keyword identifier of current token */
+	int tok_cursep;			/* current character is a separator */
+	int tok_prevsep;		/* previous character was a separator */
+	int eqn_beg, eqn_end;		/* inline eqn delimiters */
+	/* def.c: definitions */
+	char bracketsizes[32][NSIZES][BRLEN];	/* bracket sizes */
+	char bracketpieces[32][8][BRLEN];	/* large bracket pieces */
+	struct gtype *gtypes;		/* custom glyph types */
+	int gtypes_gen;			/* incremented when gtypes[] changes */
+	int brcost_type[32];		/* extra line-break costs */
+	int brcost_cost[32];
+	int brcost_n;
+	char chopped[256];		/* characters that chop equations */
+	unsigned char def_ctab[256];	/* character classes (C_*) */
+	int e_axisheight;		/* axis height */
+	int e_minimumsize;		/* minimum size */
+	int e_overhang;
+	int e_nulldelim;
+	int e_scriptspace;
+	int e_thinspace;
+	int e_mediumspace;
+	int e_thickspace;
+	int e_num1;			/* minimum numerator rise */
+	int e_num2;
+	int e_denom1;			/* minimum denominator fall */
+	int e_denom2;
+	int e_sup1;
+	int e_sup2;
+	int e_sup3;
+	int e_sub1;
+	int e_sub2;
+	int e_supdrop;
+	int e_subdrop;
+	int e_xheight;
+	int e_rulethickness;
+	int e_bigopspacing1;
+	int e_bigopspacing2;
+	int e_bigopspacing3;
+	int e_bigopspacing4;
+	int e_bigopspacing5;
+	int e_columnsep;
+	int e_baselinesep;
+	int e_bodyheight;
+	int e_bodydepth;
+	/* box.c: boxes */
+	struct box *box_pend;		/* the box whose register lacks its end */
+	int box_pendpos;		/* the unwritten part of box_pend->raw */
+	int box_pendds;			/* box_pend's register is not defined yet */
+	int box_env;			/* changes with troff's point size or font */
+	char box_ps[RLEN];		/* the last .ps argument; empty if unknown */
+	int box_psver;			/* nregver() of its register */
+	char box_ft[GNLEN];		/* the last .ft argument; empty if unknown */
+	int box_peepon;			/* simplify the contents with box_peep() */
+	int box_predone;		/* box_prelude() is called */
+	struct sbuf box_text;		/* the text inserted by box_puttext() */
+	struct glyph *glyphs;		/* glyph_len() cache */
+	int glyphs_n;
+	/* eqn.c: equations */
+	char gfont[FNLEN];
+	char grfont[FNLEN];
+	char gbfont[FNLEN];
+	char gsize[FNLEN];
+	char eqn_lineup[128];		/* the lineup horizontal request */
+	int eqn_lineupreg;		/* the number register holding lineup width */
+	int eqn_mk;			/* the value of MK */
+	int eqn_flags;			/* NEATEQN_* flags */
+	struct sbuf eqn_out;		/* the output of the current equation */
+	struct sbuf eqn_doc;		/* the output of neateqn_compile() */
+	/* reg.c: registers */
+	struct regs *sregs;		/* string registers */
+	struct regs *nregs;		/* number registers */
+	struct regs *kregs;		/* number registers never freed */
+	char escbuf[256];		/* the value returned by escarg() */
+	/* live.c: removing unused requests */
+	char **lv_beg;			/* the lines of an equation */
+	int *lv_flg;			/* line flags */
+	int *lv_rdbeg;			/* the first register in lv_rd[] read by lines */
+	int lv_sz;			/* number of allocated lines */
+	int *lv_rd;			/* registers read by the lines */
+	int lv_nrd, lv_rdsz;		/* number of entries in lv_rd[] and its size */
+	char lv_live[LV_NREGS + 1];	/* registers read later */
+	char lv_pin[LV_NREGS + 1];	/* registers never removed */
+	int lv_reqs, lv_drops;		/* number of requests and removed ones */
+	/* mem.c: per-equation memory */
+	struct mblk *mem_head;		/* the first block */
+	struct mblk *mem_cur;		/* the block allocations come from */
+	/* out.c: output */
+	char obuf[OBUFSZ];		/* output buffered for out_fd */
+	int obuf_len;			/* number of bytes in obuf */
+	int out_fd;			/* output file descriptor */
+	struct sbuf *out_sb;		/* in-memory output, if not NULL */
+	void (*out_pend)(void);		/* writes deferred output */
+	struct sbuf *out_doc;		/* in-memory document, if not NULL */
+	/* error recovery */
+	jmp_buf err;			/* errdie() jumps here */
+};
+
+/* the instance of the current thread, during neateqn_*() calls only */
+extern __thread struct neateqn *ctx;
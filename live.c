@@ -0,0 +1,239 @@
+/* removing requests that set unused number registers */
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eqn.h"
+
+#define LV_BB		LV_NREGS	/* bounding box registers set by \w */
+
+#define LV_COND		1		/* executed conditionally */
+#define LV_MACRO	2		/* inside a macro definition */
+#define LV_DROP		4		/* removed */
+#define LV_WD		8		/* uses \w */
+#define LV_REQ		16		/* .nr, .if, .ie, or .el request */
+
+/* the identifier of register name of length n, or -1 if not tracked */
+static int lv_id(char *name, int n)
+{
+	int i, id = 0;
+	if (n == 5 && name[0] == 'b' && name[1] == 'b')
+		return LV_BB;
+	for (i = 0; i < n && id < LV_NREGS; i++) {
+		if (name[i] < '0' || name[i] > '9')
+			return -1;
+		id = id * 10 + name[i] - '0';
+	}
+	return n >= 2 && id < LV_NREGS ? id : -1;
+}
+
+/* the register whose name, as in escape sequences, starts at s */
+static int lv_reg(char *s, char **end)
+{
+	int n = 1;
+	if (*s == '(') {
+		n = 2;
+		s++;
+	} else if (*s == '[') {
+		n = strcspn(++s, "]\n");
+		*end = s + n + (s[n] == ']');
+		return lv_id(s, n);
+	}
+	n = s[0] && s[0] != '\n' ? (n > 1 && s[1] && s[1] != '\n' ? 2 : 1) : 0;
+	*end = s + n;
+	return lv_id(s, n);
+}
+
+/* record that the current line reads register reg */
+static void lv_read(int reg)
+{
+	if (ctx->lv_nrd == ctx->lv_rdsz) {
+		ctx->lv_rdsz = ctx->lv_rdsz ? ctx->lv_rdsz * 2 : 1024;
+		ctx->lv_rd = realloc(ctx->lv_rd, ctx->lv_rdsz * sizeof(ctx->lv_rd[0]));
+	}
+	ctx->lv_rd[ctx->lv_nrd++] = reg;
+}
+
+/* scan the line at s for flags, blocks and pinned registers; end it */
+static char *lv_line(char *s, char *end, int *flg, int *depth, int macro)
+{
+	int req = !strncmp(".if ", s, 4) || !strncmp(".ie ", s, 4) ||
+		!strncmp(".el ", s, 4);
+	int cond = *depth || req;
+	char *e = memchr(s, '\n', end - s);
+	int esc, reg;
+	if (!e)
+		e = end;
+	*e = '\0';
+	*flg = *depth || macro ? LV_COND : 0;
+	if (req || !strncmp(".nr ", s, 4))
+		*flg |= LV_REQ;
+	while ((s = memchr(s, '\\', e - s)) != NULL) {
+		for (esc = 0, s++; *s == '\\' || *s == 'E'; esc++)
+			s++;
+		switch (*s) {
+		case '{':
+			*depth += cond;
+			break;
+		case '}':
+			*depth -= cond && *depth > 0;
+			break;
+		case 'w':
+			*flg |= LV_WD;
+			break;
+		case 'R':
+			if (s[1] == '\'' && (reg = lv_id(s + 2, strcspn(s + 2, " '"))) >= 0)
+				ctx->lv_pin[reg] = 1;
+			break;
+		case 'k':
+			if ((reg = lv_reg(s + 1, &s)) >= 0)
+				ctx->lv_pin[reg] = 1;
+			continue;
+		case 'n':
+			s += s[1] == '+' || s[1] == '-';
+			if ((reg = lv_reg(s + 1, &s)) < 0)
+				continue;
+			if (esc || macro)
+				ctx->lv_pin[reg] = 1;
+			lv_read(reg);
+			continue;
+		}
+		if (*s)
+			s++;
+	}
+	if (*depth)
+		*flg |= LV_COND;
+	return e < end ? e + 1 : end;
+}
+
+/* the register line i sets, if it may be removed; otherwise -1 */
+static int lv_def(int i, int *cond, int *incr)
+{
+	char *s = ctx->lv_beg[i];
+	int reg, n;
+	*cond = !strncmp(".if ", s, 4) || !strncmp(".ie ", s, 4) ||
+		!strncmp(".el ", s, 4);
+	if (ctx->lv_flg[i] & (LV_COND | LV_MACRO))
+		return -1;
+	if (*cond && s[1] == 'i') {	/* skipping the condition */
+		s += 4;
+		n = strcspn(s, " ");
+		if (memchr(s, '\'', n) || memchr(s, '"', n) || s[n] != ' ')
+			return -1;
+		s += n + 1;
+	} else if (*cond) {
+		s += 4;
+	}
+	if (strncmp(".nr ", s, 4))
+		return -1;
+	s += 4;
+	reg = lv_id(s, strcspn(s, " "));
+	s += strcspn(s, " ");
+	if (reg < 0 || reg == LV_BB || ctx->lv_pin[reg] || *s != ' ')
+		return -1;
+	*incr = s[1] == '+' || s[1] == '-';
+	return reg;
+}
+
+/* mark the lines setting registers that are not read afterwards */
+static void lv_pass(int n)
+{
+	int i, j, k, reg, cond, cond2, incr, incr2, wd;
+	memset(ctx->lv_live, 0, sizeof(ctx->lv_live));
+	ctx->lv_live[LV_BB] = 1;
+	for (i = n - 1; i >= 0; i = j - 1) {
+		j = i;
+		if (ctx->lv_flg[i] & LV_MACRO)
+			continue;
+		incr = 0;
+		cond = 0;
+		reg = ctx->lv_flg[i] & LV_REQ ? lv_def(i, &cond, &incr) : -1;
+		if (reg >= 0 && !strncmp(".ie ", ctx->lv_beg[i], 4))
+			reg = -1;
+		if (reg >= 0 && ctx->lv_beg[i][1] == 'e') {	/* .ie and .el pairs */
+			if (i > 0 && !strncmp(".ie ", ctx->lv_beg[i - 1], 4) &&
+					lv_def(i - 1, &cond2, &incr2) == reg) {
+				j = i - 1;
+				cond = 0;
+				incr |= incr2;
+			} else {
+				reg = -1;
+			}
+		}
+		for (wd = 0, k = j; k <= i; k++)
+			wd |= ctx->lv_flg[k] & LV_WD;
+		if (reg >= 0 && !ctx->lv_live[reg] && (!wd || !ctx->lv_live[LV_BB])) {
+			for (k = j; k <= i; k++)
+				ctx->lv_flg[k] |= LV_DROP;
+			continue;
+		}
+		if (reg >= 0 && !cond) {
+			ctx->lv_live[reg] = 0;
+			if (wd && j == i)
+				ctx->lv_live[LV_BB] = 0;
+		}
+		for (k = ctx->lv_rdbeg[j]; k < ctx->lv_rdbeg[i + 1]; k++)
+			ctx->lv_live[ctx->lv_rd[k]] = 1;
+		if (reg >= 0 && incr)
+			ctx->lv_live[reg] = 1;
+	}
+}
+
+/* write the output of an equation, omitting requests that set unread registers */
+void live_out(char *eqn)
+{
+	char *s = eqn;
+	int depth = 0, macro = 0;
+	char *end = eqn + strlen(eqn);
+	int nl = end > eqn && end[-1] == '\n';
+	int i, n = 0;
+	ctx->lv_nrd = 0;
+	memset(ctx->lv_pin, 0, sizeof(ctx->lv_pin));
+	while (*s) {
+		if (n == ctx->lv_sz) {
+			int sz = ctx->lv_sz ? ctx->lv_sz * 2 : 512;
+			ctx->lv_beg = realloc(ctx->lv_beg, sz * sizeof(char *));
+			ctx->lv_flg = realloc(ctx->lv_flg, sz * sizeof(int));
+			ctx->lv_rdbeg = realloc(ctx->lv_rdbeg, (sz + 1) * sizeof(int));
+			ctx->lv_sz = sz;
+		}
+		ctx->lv_rdbeg[n] = ctx->lv_nrd;
+		ctx->lv_beg[n] = s;
+		if (!macro && !strncmp(".de ", s, 4))
+			macro = 1;
+		s = lv_line(s, end, &ctx->lv_flg[n], &depth, macro);
+		if (macro)
+			ctx->lv_flg[n] |= LV_MACRO;
+		else if (ctx->lv_beg[n][0] == '.')
+			ctx->lv_reqs++;
+		if (macro && !strcmp("..", ctx->lv_beg[n]))
+			macro = 0;
+		n++;
+	}
+	ctx->lv_rdbeg[n] = ctx->lv_nrd;
+	lv_pass(n);
+	for (i = 0; i < n; i++) {
+		if (ctx->lv_flg[i] & LV_DROP) {
+			ctx->lv_drops++;
+			continue;
+		}
+		out_append(ctx->lv_beg[i]);
+		if (i + 1 < n || nl)
+			out_add('\n');
+	}
+}
+
+/* report the number of removed requests */
+void live_stats(void)
+{
+	fprintf(stderr, "neateqn: %d of %d requests removed\n",
+		ctx->lv_drops, ctx->lv_reqs);
+}
+
+void live_done(void)
+{
+	free(ctx->lv_beg);
+	free(ctx->lv_flg);
+	free(ctx->lv_rdbeg);
+	free(ctx->lv_rd);
+}
@@ -0,0 +1,146 @@
+/* the neateqn command */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "neateqn.h"
+
+#define NTHREADS	256	/* maximum number of worker threads */
+
+/* a document converted in batch mode */
+struct job {
+	char *src;		/* input file */
+	char *dst;		/* output file */
+};
+
+static struct neateqn *base;	/* the options and built-in definitions */
+static struct job *jobs;
+static int jobs_n;
+static int jobs_next;		/* the next job to start */
+static int jobs_failed;		/* the number of failed jobs */
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* convert a document with a new instance, as if done by another process */
+static int job_run(struct job *job)
+{
+	struct neateqn *eqn;
+	int ifd, ofd;
+	int ret;
+	if ((ifd = open(job->src, O_RDONLY)) < 0) {
+		fprintf(stderr, "neateqn: cannot open <%s>\n", job->src);
+		return 1;
+	}
+	if ((ofd = open(job->dst, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		fprintf(stderr, "neateqn: cannot create <%s>\n", job->dst);
+		close(ifd);
+		return 1;
+	}
+	eqn = neateqn_share(base);
+	ret = neateqn_run(eqn, ifd, ofd);
+	neateqn_free(eqn);
+	close(ifd);
+	close(ofd);
+	return ret != 0;
+}
+
+static void *job_worker(void *arg)
+{
+	int i, failed;
+	while (1) {
+		pthread_mutex_lock(&jobs_lock);
+		i = jobs_next++;
+		pthread_mutex_unlock(&jobs_lock);
+		if (i >= jobs_n)
+			break;
+		failed = job_run(&jobs[i]);
+		pthread_mutex_lock(&jobs_lock);
+		jobs_failed += failed;
+		pthread_mutex_unlock(&jobs_lock);
+	}
+	return NULL;
+}
+
+/* convert the documents in jobs[] with n threads */
+static int batch(int n)
+{
+	pthread_t threads[NTHREADS];
+	int i;
+	n = n < jobs_n ? n : jobs_n;
+	n = n < NTHREADS ? n : NTHREADS;
+	for (i = 1; i < n; i++)
+		if (pthread_create(&threads[i], NULL, job_worker, NULL))
+			break;
+	n = i;
+	job_worker(NULL);
+	for (i = 1; i < n; i++)
+		pthread_join(threads[i], NULL);
+	return jobs_failed > 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct neateqn *eqn;
+	char *chopped = NULL;
+	char *dst;
+	int flags = 0;
+	int nthreads = 1;
+	int ret;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-' || !argv[i][1])
+			break;
+		if (!strcmp("-dump-ir", argv[i])) {
+			flags |= NEATEQN_DUMP;
+		} else if (argv[i][1] == 'c') {
+			chopped = argv[i][2] ? argv[i] + 2 : argv[++i];
+		} else if (argv[i][1] == 'j' && (argv[i][2] || i + 1 < argc)) {
+			nthreads = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+		} else if (argv[i][1] == 'l') {
+			flags |= NEATEQN_LIVE;
+		} else if (argv[i][1] == 'p') {
+			flags |= NEATEQN_NOPEEP;
+		} else if (argv[i][1] == 's') {
+			flags |= NEATEQN_STATS;
+		} else {
+			break;
+		}
+	}
+	jobs = malloc((argc - i + 1) * sizeof(jobs[0]));
+	while (i + 1 < argc && argv[i][0] != '-') {
+		if (strncmp("-o", argv[i + 1], 2))
+			break;
+		dst = argv[i + 1][2] ? argv[i + 1] + 2 : argv[i + 2];
+		if (!dst)
+			break;
+		jobs[jobs_n].src = argv[i];
+		jobs[jobs_n++].dst = dst;
+		i += argv[i + 1][2] ? 2 : 3;
+	}
+	/* like older versions, ignore files not followed by -o */
+	if (i < argc && (jobs_n || (argv[i][0] == '-' && argv[i][1]))) {
+		printf("Usage: neateqn [options] <input >output\n");
+		printf("       neateqn [options] input -o output ...\n\n");
+		printf("Options:\n");
+		printf("  -c chars  \tcharacters that chop equations\n");
+		printf("  -l        \tremove requests setting unread registers\n");
+		printf("  -p        \tdo not simplify motions and font changes\n");
+		printf("  -s        \tprint register usage and removed requests\n");
+		printf("  -j n      \tconvert the given files with n threads\n");
+		printf("  -dump-ir  \tprint the parse tree of equations\n");
+		free(jobs);
+		return 1;
+	}
+	if (jobs_n) {
+		base = neateqn_alloc(chopped, flags);
+		ret = batch(nthreads);
+		neateqn_free(base);
+	} else {
+		eqn = neateqn_alloc(chopped, flags);
+		ret = neateqn_run(eqn, 0, 1) != 0;
+		neateqn_free(eqn);
+	}
+	free(jobs);
+	return ret;
+}
@@ -0,0 +1,75 @@
+/* memory released together after each equation */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eqn.h"
+
+#define MEMBLK		(1 << 16)	/* the size of memory blocks */
+#define MEMALIGN	16		/* the alignment of allocations */
+
+struct mblk {
+	char *buf;		/* the memory */
+	long sz;		/* size of buf */
+	long n;			/* bytes allocated from buf */
+	struct mblk *next;	/* the next block */
+};
+
+static struct mblk *mem_blk(long sz)
+{
+	struct mblk *blk = malloc(sizeof(*blk));
+	blk->sz = MAX(sz, MEMBLK);
+	blk->buf = malloc(blk->sz);
+	blk->n = 0;
+	blk->next = NULL;
+	return blk;
+}
+
+/* allocate n bytes; they are valid until mem_reset() */
+void *mem_alloc(long n)
+{
+	void *p;
+	n = (n + MEMALIGN - 1) & ~(long) (MEMALIGN - 1);
+	if (!ctx->mem_cur)
+		ctx->mem_head = ctx->mem_cur = mem_blk(n);
+	while (ctx->mem_cur->n + n > ctx->mem_cur->sz) {
+		if (!ctx->mem_cur->next || ctx->mem_cur->next->sz < n) {
+			struct mblk *blk = mem_blk(n);
+			blk->next = ctx->mem_cur->next;
+			ctx->mem_cur->next = blk;
+		}
+		ctx->mem_cur = ctx->mem_cur->next;
+	}
+	p = ctx->mem_cur->buf + ctx->mem_cur->n;
+	ctx->mem_cur->n += n;
+	return p;
+}
+
+/* a copy of s in the memory of this equation */
+char *mem_str(char *s)
+{
+	int n = strlen(s);
+	char *d = mem_alloc(n + 1);
+	memcpy(d, s, n + 1);
+	return d;
+}
+
+/* release all allocations, keeping the blocks for reuse */
+void mem_reset(void)
+{
+	struct mblk *blk;
+	for (blk = ctx->mem_head; blk; blk = blk->next)
+		blk->n = 0;
+	ctx->mem_cur = ctx->mem_head;
+}
+
+/* release the blocks */
+void mem_done(void)
+{
+	while (ctx->mem_head) {
+		ctx->mem_cur = ctx->mem_head->next;
+		free(ctx->mem_head->buf);
+		free(ctx->mem_head);
+		ctx->mem_head = ctx->mem_cur;
+	}
+}
@@ -0,0 +1,31 @@
+/*
+ * NEATEQN LIBRARY INTERFACE
+ *
+ * A neateqn instance converts eqn input into troff input, like the
+ * neateqn command.  Instances share no state; different threads may
+ * use different instances at the same time.  Each call works on the
+ * instance passed to it, so a thread may use several instances in
+ * turn and an instance may move to another thread between calls, but
+ * it may not be used by two threads at once.  The instances returned
+ * by neateqn_share() read the built-in definitions of their base,
+ * which should be freed after them.  The definitions of an input,
+ * like define, delim and gfont, remain in effect for the next inputs
+ * of the same instance.  After an error, which is reported to the
+ * standard error, the instance may only be freed.
+ */
+#define NEATEQN_NOPEEP	0x01	/* do not simplify motions and font changes */
+#define NEATEQN_STATS	0x02	/* print register usage and removed requests */
+#define NEATEQN_DUMP	0x04	/* print the parse tree of equations */
+#define NEATEQN_LIVE	0x08	/* remove requests setting unread registers */
+
+struct neateqn;
+
+/* create an instance; chopped replaces the characters that chop equations */
+struct neateqn *neateqn_alloc(char *chopped, int flags);
+/* create an instance with the options and built-in definitions of base */
+struct neateqn *neateqn_share(struct neateqn *base);
+void neateqn_free(struct neateqn *eqn);
+/* convert len bytes at in; return the length of *out or -1 on errors */
+int neateqn_compile(struct neateqn *eqn, char *in, long len, char **out);
+/* convert the input read from ifd and write it to ofd; -1 on errors */
+int neateqn_run(struct neateqn *eqn, int ifd, int ofd);
@@ -0,0 +1,145 @@
+/* buffered output */
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include "eqn.h"
+
+/* call the pending out_defer() function */
+static void out_pending(void)
+{
+	void (*pend)(void) = ctx->out_pend;
+	ctx->out_pend = NULL;
+	pend();
+}
+
+/* write the output deferred so far and call pend before any other output */
+void out_defer(void (*pend)(void))
+{
+	if (ctx->out_pend)
+		out_pending();
+	ctx->out_pend = pend;
+}
+
+static void out_write(char *s, long n)
+{
+	long w;
+	if (ctx->out_doc) {
+		sbuf_mem(ctx->out_doc, s, n);
+		return;
+	}
+	while (n > 0) {
+		if ((w = write(ctx->out_fd, s, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			errdie("neateqn: cannot write the output\n");
+		}
+		s += w;
+		n -= w;
+	}
+}
+
+/* write the buffered output */
+void out_flush(void)
+{
+	int n;
+	if (ctx->out_pend)
+		out_pending();
+	n = ctx->obuf_len;
+	ctx->obuf_len = 0;
+	out_write(ctx->obuf, n);
+}
+
+/* send the output to sb, or to the document if sb is NULL */
+void out_to(struct sbuf *sb)
+{
+	if (ctx->out_pend)
+		out_pending();
+	ctx->out_sb = sb;
+}
+
+/* write the document to doc, or to file descriptor fd if doc is NULL */
+void out_dest(int fd, struct sbuf *doc)
+{
+	out_flush();
+	ctx->out_fd = fd;
+	ctx->out_doc = doc;
+}
+
+void out_mem(char *s, long n)
+{
+	if (ctx->out_pend)
+		out_pending();
+	if (ctx->out_sb) {
+		sbuf_mem(ctx->out_sb, s, n);
+		return;
+	}
+	if (ctx->obuf_len + n > OBUFSZ) {
+		out_flush();
+		if (n >= OBUFSZ) {
+			out_write(s, n);
+			return;
+		}
+	}
+	memcpy(ctx->obuf + ctx->obuf_len, s, n);
+	ctx->obuf_len += n;
+}
+
+void out_add(int c)
+{
+	if (ctx->out_pend)
+		out_pending();
+	if (ctx->out_sb) {
+		sbuf_add(ctx->out_sb, c);
+		return;
+	}
+	if (ctx->obuf_len == OBUFSZ)
+		out_flush();
+	ctx->obuf[ctx->obuf_len++] = c;
+}
+
+void out_append(char *s)
+{
+	out_mem(s, strlen(s));
+}
+
+void out_int(int n)
+{
+	char buf[16];
+	char *s = buf + sizeof(buf);
+	unsigned u = n < 0 ? -(unsigned) n : n;
+	do {
+		*--s = '0' + u % 10;
+	} while (u /= 10);
+	if (n < 0)
+		*--s = '-';
+	out_mem(s, buf + sizeof(buf) - s);
+}
+
+/* formatted output; only %s, %d, %c, and %% are supported */
+void out(char *s, ...)
+{
+	va_list ap;
+	char *r;
+	va_start(ap, s);
+	while ((r = strchr(s, '%'))) {
+		out_mem(s, r - s);
+		switch (r[1]) {
+		case 's':
+			out_append(va_arg(ap, char *));
+			break;
+		case 'd':
+			out_int(va_arg(ap, int));
+			break;
+		case 'c':
+			out_add(va_arg(ap, int));
+			break;
+		default:
+			out_add(r[1]);
+		}
+		s = r + 2;
+	}
+	out_append(s);
+	va_end(ap);
+}
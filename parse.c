@@ -0,0 +1,411 @@
+/* parsing equations into trees */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eqn.h"
+
+/* flags passed to parse_left() */
+#define P_SUB		0x01	/* this is a subscript */
+#define P_FROM		0x02	/* this is a from block */
+
+static struct node *parse_box(void);
+static struct node *parse_left(int flg);
+
+static struct node *node_mk(int type)
+{
+	struct node *node = mem_alloc(sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	return node;
+}
+
+/* append a node to the list whose last next pointer is *tail */
+static struct node *node_put(struct node ***tail, int type)
+{
+	struct node *node = node_mk(type);
+	**tail = node;
+	*tail = &node->next;
+	return node;
+}
+
+static char *tok_text(char *s)
+{
+	return s ? s : "";
+}
+
+static char *tok_quotes(char *s)
+{
+	if (s && s[0] == '"') {
+		s[strlen(s) - 1] = '\0';
+		return s + 1;
+	}
+	return s ? s : "";
+}
+
+static char *tok_improve(char *s)
+{
+	if (s && s[0] == '-' && s[1] == '\0')
+		return "\\(mi";
+	if (s && s[0] == '+' && s[1] == '\0')
+		return "\\(pl";
+	if (s && s[0] == '\'' && s[1] == '\0')
+		return "\\(fm";
+	return tok_quotes(s);
+}
+
+/* check the next token */
+static void tok_expect(int kwd)
+{
+	struct sbuf msg;
+	if (tok_jmp(kwd)) {
+		sbuf_initmem(&msg);	/* released with the equation */
+		sbuf_printf(&msg, "neateqn: expected %s but got %s\n",
+			tok_kwdname(kwd), tok_get() ? tok_get() : "the end");
+		errdie(sbuf_buf(&msg));
+	}
+}
+
+/* append the next command argument to the list at tail */
+static void parse_arg(struct node ***tail, int quoted)
+{
+	char *s = tok_poptext(1);
+	node_put(tail, N_TEXT)->s = mem_str(quoted ? tok_quotes(s) : tok_text(s));
+}
+
+static int typenum(char *s)
+{
+	if (!strcmp("ord", s) || !strcmp("ordinary", s))
+		return T_ORD;
+	if (!strcmp("op", s) || !strcmp("operator", s))
+		return T_BIGOP;
+	if (!strcmp("bin", s) || !strcmp("binary", s))
+		return T_BINOP;
+	if (!strcmp("rel", s) || !strcmp("relation", s))
+		return T_RELOP;
+	if (!strcmp("open", s) || !strcmp("opening", s))
+		return T_LEFT;
+	if (!strcmp("close", s) || !strcmp("closing", s))
+		return T_RIGHT;
+	if (!strcmp("punct", s) || !strcmp("punctuation", s))
+		return T_PUNC;
+	if (!strcmp("inner", s))
+		return T_INNER;
+	return T_ORD;
+}
+
+/* read chartype command arguments and perform it */
+static void parse_chartype(void)
+{
+	char gl[GNLEN], type[NMLEN];
+	snprintf(type, sizeof(type), "%s", tok_quotes(tok_poptext(1)));
+	snprintf(gl, sizeof(gl), "%s", tok_quotes(tok_poptext(1)));
+	if (typenum(type) >= 0)
+		def_typeput(gl, typenum(type));
+}
+
+/* read general eqn commands; those affecting the layout are added at tail */
+static int parse_commands(struct node ***tail)
+{
+	struct node *cmd;
+	struct node **args;
+	int kwd = tok_kwd();
+	int i, n;
+	if (kwd < K_DELIM || kwd > K_BREAKCOST)
+		return 1;
+	tok_pop();
+	switch (kwd) {
+	case K_DELIM:
+		tok_delim();
+		return 0;
+	case K_DEFINE:
+		tok_macro();
+		return 0;
+	case K_CHARTYPE:
+		parse_chartype();
+		return 0;
+	}
+	cmd = node_put(tail, N_CMD);
+	cmd->kwd = kwd;
+	args = &cmd->kid;
+	switch (kwd) {
+	case K_SET:
+		parse_arg(&args, 0);
+		parse_arg(&args, 0);
+		break;
+	case K_BRACKETSIZES:
+		parse_arg(&args, 1);
+		n = atoi(tok_text(tok_poptext(1)));
+		for (i = 0; i < n; i++)
+			parse_arg(&args, 1);
+		break;
+	case K_BRACKETPIECES:
+		for (i = 0; i < 5; i++)
+			parse_arg(&args, 1);
+		break;
+	case K_BREAKCOST:
+		parse_arg(&args, 1);
+		cmd->val = !strcmp("any", cmd->kid->s) ? 0 : typenum(cmd->kid->s);
+		parse_arg(&args, 0);
+		break;
+	default:
+		parse_arg(&args, 1);
+	}
+	return 0;
+}
+
+/* read user-specified spaces */
+static int parse_gaps(struct node ***tail)
+{
+	int kwd = tok_kwd();
+	if (kwd < K_GAP || kwd > K_TAB)
+		return 1;
+	tok_pop();
+	node_put(tail, N_GAP)->kwd = kwd;
+	return 0;
+}
+
+/* read boxes into list until keyword delim is read */
+static int parse_until(struct node *list, int delim)
+{
+	struct node **tail = &list->kid;
+	while (tok_get() && tok_jmp(delim)) {
+		if (tok_kwd() == K_RBRACE)
+			return 1;
+		*tail = parse_box();
+		tail = &(*tail)->next;
+	}
+	return 0;
+}
+
+/* read the rows of a pile or a matrix column, separated with above */
+static void parse_rows(struct node *node)
+{
+	struct node **tail = &node->kid;
+	int n = 0;
+	while (n++ < NPILES && !parse_until(node_put(&tail, N_LIST), K_ABOVE))
+		;
+	tok_expect(K_RBRACE);
+}
+
+/* read pile command */
+static void parse_pile(struct node *pile)
+{
+	if (tok_jmp(K_LBRACE)) {
+		pile->val = atoi(tok_text(tok_poptext(1)));
+		tok_expect(K_LBRACE);
+	}
+	parse_rows(pile);
+}
+
+/* read matrix command */
+static void parse_matrix(struct node *matrix)
+{
+	struct node **tail = &matrix->kid;
+	struct node *col;
+	int ncols = 0;
+	int kwd;
+	if (tok_jmp(K_LBRACE)) {
+		matrix->val = atoi(tok_text(tok_poptext(1)));
+		tok_expect(K_LBRACE);
+	}
+	while ((kwd = tok_kwd()) >= K_COL && kwd <= K_RCOL && ncols++ < NPILES) {
+		tok_pop();
+		col = node_put(&tail, N_COL);
+		col->kwd = 'c';
+		if (kwd == K_LCOL)
+			col->kwd = 'l';
+		if (kwd == K_RCOL)
+			col->kwd = 'r';
+		if (tok_jmp(K_LBRACE)) {
+			col->val = atoi(tok_text(tok_poptext(1)));
+			tok_expect(K_LBRACE);
+		}
+		parse_rows(col);
+	}
+	tok_expect(K_RBRACE);
+}
+
+/* read the text of a bracket after left or right */
+static char *parse_bracket(void)
+{
+	char br[NMLEN];
+	snprintf(br, sizeof(br), "%s", tok_quotes(tok_poptext(0)));
+	return mem_str(br);
+}
+
+/* read a box without fractions */
+static struct node *parse_left(int flg)
+{
+	struct node *left = node_mk(N_LEFT);
+	struct node **tail = &left->kid;
+	struct node **atoms;
+	struct node *node;
+	int sub, from;
+	int kwd;
+	while (!parse_commands(&tail))
+		;
+	if (!parse_gaps(&tail)) {
+		while (!parse_gaps(&tail))
+			;
+		return left;
+	}
+	while ((kwd = tok_kwd()) >= K_FWD && kwd <= K_SIZE) {
+		tok_pop();
+		switch (kwd) {
+		case K_ROMAN:
+		case K_ITALIC:
+		case K_BOLD:
+			node_put(&tail, N_FONT)->kwd = kwd;
+			break;
+		case K_FONT:
+			node = node_put(&tail, N_FONT);
+			node->kwd = kwd;
+			node->s = mem_str(tok_text(tok_poptext(1)));
+			break;
+		case K_SIZE:
+			node_put(&tail, N_SIZE)->s = mem_str(tok_text(tok_poptext(1)));
+			break;
+		case K_FWD:
+		case K_BACK:
+		case K_DOWN:
+		case K_UP:
+			node = node_put(&tail, N_MOVE);
+			node->kwd = kwd;
+			node->val = atoi(tok_text(tok_poptext(1)));
+		}
+	}
+	switch (kwd) {
+	case K_SQRT:
+		tok_pop();
+		node_put(&tail, N_SQRT)->kid = parse_left(0);
+		break;
+	case K_PILE:
+	case K_CPILE:
+	case K_LPILE:
+	case K_RPILE:
+		tok_pop();
+		node = node_put(&tail, N_PILE);
+		node->kwd = kwd == K_LPILE ? 'l' : (kwd == K_RPILE ? 'r' : 'c');
+		parse_pile(node);
+		break;
+	case K_MATRIX:
+		tok_pop();
+		parse_matrix(node_put(&tail, N_MATRIX));
+		break;
+	case K_VCENTER:
+		tok_pop();
+		node_put(&tail, N_VCENTER)->kid = parse_left(flg);
+		break;
+	case K_LBRACE:
+		tok_pop();
+		parse_until(node_put(&tail, N_LIST), K_RBRACE);
+		break;
+	case K_LEFT:
+		tok_pop();
+		node = node_put(&tail, N_BRACKET);
+		node->s = parse_bracket();
+		node->kid = node_mk(N_LIST);
+		parse_until(node->kid, K_RIGHT);
+		node->t = parse_bracket();
+		break;
+	default:
+		if (!tok_get() || tok_type() == T_KEYWORD)
+			break;
+		node = node_put(&tail, N_ATOMS);
+		atoms = &node->kid;
+		do {
+			struct node *atom = node_put(&atoms, N_ATOM);
+			int chops;
+			atom->kwd = tok_type();
+			atom->s = mem_str(tok_improve(tok_get()));
+			chops = tok_chops(0);
+			tok_pop();
+			if (chops)		/* what we read was a splitting */
+				break;
+		} while (!tok_chops(0));	/* the next token is splitting */
+	}
+	while ((kwd = tok_kwd()) >= K_BAR && kwd <= K_TILDE) {
+		tok_pop();
+		node_put(&tail, N_ACCENT)->kwd = kwd;
+	}
+	if ((sub = !tok_jmp(K_SUB)))
+		node_put(&tail, N_SUB)->kid = parse_left(P_SUB);
+	if ((sub || !(flg & P_SUB)) && !tok_jmp(K_SUP))
+		node_put(&tail, N_SUP)->kid = parse_left(0);
+	if ((from = !tok_jmp(K_FROM)))
+		node_put(&tail, N_FROM)->kid = parse_left(P_FROM);
+	if ((from || !(flg & P_FROM)) && !tok_jmp(K_TO))
+		node_put(&tail, N_TO)->kid = parse_left(0);
+	return left;
+}
+
+/* read a box */
+static struct node *parse_box(void)
+{
+	struct node *box = parse_left(0);
+	struct node *over;
+	while (!tok_jmp(K_OVER)) {
+		over = node_mk(N_OVER);
+		over->kid = box;
+		box->next = parse_left(0);
+		box = over;
+	}
+	return box;
+}
+
+/* read an equation, either inline or block */
+struct node *parse_eqn(void)
+{
+	struct node *eqn = node_mk(N_EQN);
+	struct node **tail = &eqn->kid;
+	while (tok_get()) {
+		if (!tok_jmp(K_MARK)) {
+			node_put(&tail, N_MARK);
+			continue;
+		}
+		if (!tok_jmp(K_LINEUP)) {
+			node_put(&tail, N_LINEUP);
+			continue;
+		}
+		*tail = parse_box();
+		tail = &(*tail)->next;
+	}
+	return eqn;
+}
+
+static char *node_names[] = {
+	[N_EQN] = "eqn", [N_MARK] = "mark", [N_LINEUP] = "lineup",
+	[N_OVER] = "over", [N_LEFT] = "box", [N_LIST] = "list",
+	[N_CMD] = "command", [N_TEXT] = "text", [N_GAP] = "gap",
+	[N_FONT] = "font", [N_SIZE] = "size", [N_MOVE] = "move",
+	[N_SQRT] = "sqrt", [N_PILE] = "pile", [N_MATRIX] = "matrix",
+	[N_COL] = "col", [N_VCENTER] = "vcenter", [N_BRACKET] = "left",
+	[N_ATOMS] = "atoms", [N_ATOM] = "atom", [N_ACCENT] = "accent",
+	[N_SUB] = "sub", [N_SUP] = "sup", [N_FROM] = "from", [N_TO] = "to",
+};
+
+/* print the tree at node to stderr */
+void parse_dump(struct node *node, int depth)
+{
+	for (; node; node = node->next) {
+		fprintf(stderr, "%*s%s", depth * 2, "", node_names[node->type]);
+		if (node->type == N_CMD || node->type == N_GAP ||
+				node->type == N_FONT || node->type == N_MOVE ||
+				node->type == N_ACCENT)
+			fprintf(stderr, " %s", tok_kwdname(node->kwd));
+		if (node->type == N_PILE || node->type == N_COL)
+			fprintf(stderr, " %c", node->kwd);
+		if (node->type == N_ATOM)
+			fprintf(stderr, " %02x", node->kwd);
+		if (node->val)
+			fprintf(stderr, " %d", node->val);
+		if (node->s)
+			fprintf(stderr, " \"%s\"", node->s);
+		if (node->t)
+			fprintf(stderr, " \"%s\"", node->t);
+		fprintf(stderr, "\n");
+		parse_dump(node->kid, depth + 1);
+	}
+}
@@ -1,86 +1,271 @@
+#include <ctype.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "eqn.h"
 
-#define NREGS		2048
 #define EPREFIX		""
+#define NKEEP		(1 << 24)	/* the first register never freed */
+#define NBLK		256		/* registers allocated together */
 
-static int sreg_max;		/* maximum allocated string register */
-static int sreg_free[NREGS];	/* free string registers */
-static int sreg_n;		/* number of items in sreg_free[] */
-static char sreg_name[NREGS][RLEN];
-static char sreg_read[NREGS][RLEN];
+struct reg {
+	char name[RLEN];	/* register name */
+	char read[RLEN];	/* register interpolation */
+	char cst[RLEN];		/* its value, if known in eqn */
+	int val;		/* the value of known registers */
+	int known;		/* the value is known and not set in troff */
+	int used;		/* allocated */
+	int ver;		/* changes when the register may be set */
+};
 
-static int nreg_max;
-static int nreg_free[NREGS];
-static int nreg_n;
-static char nreg_name[NREGS][RLEN];
-static char nreg_read[NREGS][RLEN];
+/* a growable table of registers; they are never moved */
+struct regs {
+	struct reg **tab;	/* blocks of NBLK registers */
+	int sz;			/* number of registers in tab[] */
+	int first;		/* the first register to allocate */
+	int low;		/* no free register below low */
+	int max;		/* maximum allocated register */
+	char *fmt;		/* register name format */
+	char *esc;		/* interpolation escape */
+};
+
+/* the initial state of register tables */
+static struct regs sregs_def = {NULL, 0, 12, 12, 0, EPREFIX "%02d", "\\*"};
+static struct regs nregs_def = {NULL, 0, 1, 1, 0, EPREFIX "%02d", "\\n"};
+static struct regs kregs_def = {NULL, 0, 0, 0, 0, EPREFIX ".%02d", "\\n"};
+
+#define REG(rs, id)	(&(rs)->tab[(id) / NBLK][(id) % NBLK])
+
+/* allocate the lowest free register of rs */
+static int regs_alloc(struct regs *rs)
+{
+	int id = rs->low;
+	while (id < rs->sz && REG(rs, id)->used)
+		id++;
+	if (id >= rs->sz) {
+		struct reg *blk = calloc(NBLK, sizeof(blk[0]));
+		int i;
+		rs->tab = realloc(rs->tab, (rs->sz / NBLK + 1) * sizeof(rs->tab[0]));
+		rs->tab[rs->sz / NBLK] = blk;
+		for (i = 0; i < NBLK; i++) {
+			sprintf(blk[i].name, rs->fmt, rs->sz + i);
+			sprintf(blk[i].read, "%s%s", rs->esc, escarg(blk[i].name));
+		}
+		rs->sz += NBLK;
+	}
+	REG(rs, id)->used = 1;
+	rs->low = id + 1;
+	if (id > rs->max)
+		rs->max = id;
+	return id;
+}
+
+static void regs_free(struct regs *rs, int id)
+{
+	REG(rs, id)->used = 0;
+	if (id < rs->low)
+		rs->low = id;
+}
+
+static void regs_reset(struct regs *rs)
+{
+	int i;
+	for (i = 0; i < rs->sz; i++)
+		REG(rs, i)->used = 0;
+	rs->low = rs->first;
+	rs->max = 0;
+}
+
+static struct reg *nreg_get(int id)
+{
+	return id >= NKEEP ? REG(ctx->kregs, id - NKEEP) : REG(ctx->nregs, id);
+}
 
 /* allocate a troff string register */
 int sregmk(void)
 {
-	int id = sreg_n ? sreg_free[--sreg_n] : ++sreg_max;
-	sprintf(sreg_name[id], "%s%02d", EPREFIX, id);
-	sprintf(sreg_read[id], "\\*%s", escarg(sreg_name[id]));
-	return id;
+	return regs_alloc(ctx->sregs);
 }
 
 /* free a troff string register */
 void sregrm(int id)
 {
-	sreg_free[sreg_n++] = id;
+	regs_free(ctx->sregs, id);
 }
 
 char *sregname(int id)
 {
-	return sreg_name[id];
+	return REG(ctx->sregs, id)->name;
 }
 
 char *sreg(int id)
 {
-	return sreg_read[id];
+	return REG(ctx->sregs, id)->read;
 }
 
 /* allocate a troff number register */
 int nregmk(void)
 {
-	int id = nreg_n ? nreg_free[--nreg_n] : ++nreg_max;
-	sprintf(nreg_name[id], "%s%02d", EPREFIX, id);
-	sprintf(nreg_read[id], "\\n%s", escarg(nreg_name[id]));
+	int id = regs_alloc(ctx->nregs);
+	REG(ctx->nregs, id)->known = 0;
 	return id;
 }
 
+/* allocate a number register that is never freed */
+int nregkeep(void)
+{
+	return NKEEP + regs_alloc(ctx->kregs);
+}
+
 /* free a troff number register */
 void nregrm(int id)
 {
-	nreg_free[nreg_n++] = id;
+	if (id < NKEEP)
+		regs_free(ctx->nregs, id);
+}
+
+/*
+ * set number register id to val without a troff request; nreg()
+ * returns the value itself until nregname() is called for modifying it
+ */
+void nregset(int id, int val)
+{
+	struct reg *r = nreg_get(id);
+	r->known = 0;
+	r->ver++;
+	if (val < 0 || val > 999999) {	/* keep literals short and unsigned */
+		out(".nr %s %d\n", r->name, val);
+		return;
+	}
+	r->known = 1;
+	r->val = val;
+	sprintf(r->cst, "%d", val);
+}
+
+/* evaluate s, made of integers and arithmetic operators */
+static int nreg_eval(char *s, int *val)
+{
+	int n = 0, op = '+';
+	while (1) {
+		if (!isdigit((unsigned char) *s))
+			return 1;
+		n = strtol(s, &s, 10);
+		if (n > 999999)
+			return 1;
+		if (op == '+')
+			*val += n;
+		if (op == '-')
+			*val -= n;
+		if (op == '*')
+			*val *= n;
+		if (op == '/' && !n)
+			return 1;
+		if (op == '/')
+			*val /= n;
+		if (*val < -999999 || *val > 999999)
+			return 1;
+		if (!*s)
+			return 0;
+		if (!strchr("+-*/", *s))
+			return 1;
+		op = *s++;
+	}
 }
 
+/* set register id to expression s, computed here if possible */
+void nregexpr(int id, char *s)
+{
+	int val = 0;
+	nreg_get(id)->known = 0;
+	nreg_get(id)->ver++;
+	if (!nreg_eval(s, &val))
+		nregset(id, val);
+	else
+		out(".nr %s %s\n", nreg_get(id)->name, s);
+}
+
+/* return nonzero if the value of register id is known */
+int nregget(int id, int *val)
+{
+	*val = nreg_get(id)->val;
+	return nreg_get(id)->known;
+}
+
+/* the name of register id; it is defined in troff if set by nregset() */
 char *nregname(int id)
 {
-	return nreg_name[id];
+	struct reg *r = nreg_get(id);
+	r->ver++;
+	if (r->known) {
+		r->known = 0;
+		out(".nr %s %d\n", r->name, r->val);
+	}
+	return r->name;
+}
+
+/* a number that changes whenever register id may be given a new value */
+int nregver(int id)
+{
+	return nreg_get(id)->ver;
 }
 
 char *nreg(int id)
 {
-	return nreg_read[id];
+	struct reg *r = nreg_get(id);
+	return r->known ? r->cst : r->read;
 }
 
 /* free all allocated registers */
 void reg_reset(void)
 {
-	nreg_max = 0;
-	nreg_n = 0;
-	sreg_max = 11;
-	sreg_n = 0;
+	regs_reset(ctx->nregs);
+	regs_reset(ctx->sregs);
+}
+
+/* report the number of registers used since reg_reset() */
+void reg_stats(int line)
+{
+	fprintf(stderr, "neateqn: line %d: %d number and %d string registers\n",
+		line, ctx->nregs->max,
+		ctx->sregs->max ? ctx->sregs->max - ctx->sregs->first + 1 : 0);
+}
+
+static struct regs *regs_mk(struct regs *tmpl)
+{
+	struct regs *rs = malloc(sizeof(*rs));
+	memcpy(rs, tmpl, sizeof(*rs));
+	return rs;
+}
+
+static void regs_done(struct regs *rs)
+{
+	int i;
+	for (i = 0; i < rs->sz / NBLK; i++)
+		free(rs->tab[i]);
+	free(rs->tab);
+	free(rs);
+}
+
+void reg_init(void)
+{
+	ctx->sregs = regs_mk(&sregs_def);
+	ctx->nregs = regs_mk(&nregs_def);
+	ctx->kregs = regs_mk(&kregs_def);
+}
+
+void reg_done(void)
+{
+	regs_done(ctx->sregs);
+	regs_done(ctx->nregs);
+	regs_done(ctx->kregs);
 }
 
 /* format the argument of a troff escape like \s or \f */
 char *escarg(char *arg)
 {
-	static char buf[256];
+	char *buf = ctx->escbuf;
 	if (!arg[1])
 		sprintf(buf, "%c", arg[0]);
 	else if (!arg[2])
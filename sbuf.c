@@ -1,19 +1,22 @@
+#include <setjmp.h>
 #include <stdarg.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "eqn.h"
 
 #define SBUF_SZ		512
+#define SBUF_MEMSZ	64	/* initial size of sbufs in mem_alloc() memory */
 
 static void sbuf_extend(struct sbuf *sbuf, int amount)
 {
 	char *s = sbuf->s;
-	sbuf->sz = (MAX(1, amount) + SBUF_SZ - 1) & ~(SBUF_SZ - 1);
-	sbuf->s = malloc(sbuf->sz);
+	int unit = sbuf->mem ? SBUF_MEMSZ : SBUF_SZ;
+	sbuf->sz = (MAX(1, amount) + unit - 1) & ~(unit - 1);
+	sbuf->s = sbuf->mem ? mem_alloc(sbuf->sz) : malloc(sbuf->sz);
 	if (sbuf->n)
 		memcpy(sbuf->s, s, sbuf->n);
-	free(s);
+	if (!sbuf->mem)
+		free(s);
 }
 
 void sbuf_init(struct sbuf *sbuf)
@@ -22,6 +25,14 @@ void sbuf_init(struct sbuf *sbuf)
 	sbuf_extend(sbuf, SBUF_SZ);
 }
 
+/* initialize an sbuf whose memory is released by mem_reset() */
+void sbuf_initmem(struct sbuf *sbuf)
+{
+	memset(sbuf, 0, sizeof(*sbuf));
+	sbuf->mem = 1;
+	sbuf_extend(sbuf, SBUF_MEMSZ);
+}
+
 void sbuf_add(struct sbuf *sbuf, int c)
 {
 	if (sbuf->n + 2 >= sbuf->sz)
@@ -29,23 +40,62 @@ void sbuf_add(struct sbuf *sbuf, int c)
 	sbuf->s[sbuf->n++] = c;
 }
 
-void sbuf_append(struct sbuf *sbuf, char *s)
+void sbuf_mem(struct sbuf *sbuf, char *s, int len)
 {
-	int len = strlen(s);
 	if (sbuf->n + len + 1 >= sbuf->sz)
-		sbuf_extend(sbuf, sbuf->n + len + 1);
+		sbuf_extend(sbuf, MAX(sbuf->sz * 2, sbuf->n + len + 1));
 	memcpy(sbuf->s + sbuf->n, s, len);
 	sbuf->n += len;
 }
 
+void sbuf_append(struct sbuf *sbuf, char *s)
+{
+	sbuf_mem(sbuf, s, strlen(s));
+}
+
+void sbuf_int(struct sbuf *sbuf, int n)
+{
+	char buf[16];
+	char *s = buf + sizeof(buf);
+	unsigned u = n < 0 ? -(unsigned) n : n;
+	do {
+		*--s = '0' + u % 10;
+	} while (u /= 10);
+	if (n < 0)
+		*--s = '-';
+	sbuf_mem(sbuf, s, buf + sizeof(buf) - s);
+}
+
+/* append formatted text; only %s, %d, %c, and %% are supported */
+void sbuf_vprintf(struct sbuf *sbuf, char *s, va_list ap)
+{
+	char *r;
+	while ((r = strchr(s, '%'))) {
+		sbuf_mem(sbuf, s, r - s);
+		switch (r[1]) {
+		case 's':
+			sbuf_append(sbuf, va_arg(ap, char *));
+			break;
+		case 'd':
+			sbuf_int(sbuf, va_arg(ap, int));
+			break;
+		case 'c':
+			sbuf_add(sbuf, va_arg(ap, int));
+			break;
+		default:
+			sbuf_add(sbuf, r[1]);
+		}
+		s = r + 2;
+	}
+	sbuf_append(sbuf, s);
+}
+
 void sbuf_printf(struct sbuf *sbuf, char *s, ...)
 {
-	char buf[LNLEN];
 	va_list ap;
 	va_start(ap, s);
-	vsprintf(buf, s, ap);
+	sbuf_vprintf(sbuf, s, ap);
 	va_end(ap);
-	sbuf_append(sbuf, buf);
 }
 
 int sbuf_empty(struct sbuf *sbuf)
@@ -73,5 +123,6 @@ void sbuf_cut(struct sbuf *sbuf, int n)
 
 void sbuf_done(struct sbuf *sbuf)
 {
-	free(sbuf->s);
+	if (!sbuf->mem)
+		free(sbuf->s);
 }
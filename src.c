@@ -1,173 +1,493 @@
 /* reading input */
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "eqn.h"
 
 #define NARGS		10	/* number of arguments */
-#define NMACROS		512	/* number of macros */
 #define NSRCDEP		512	/* maximum esrc_depth */
+#define NUNBUF		16	/* inline push-back buffer size */
+#define IBUFSZ		(1 << 16)	/* input block size */
+
+/* reference-counted immutable string, shared by macros and esrc buffers */
+struct rstr {
+	char *s;
+	int ref;		/* the number of references */
+	struct mtok *toks;	/* compiled tokens of macro bodies */
+};
 
 /* eqn input stream */
 struct esrc {
 	struct esrc *prev;	/* previous buffer */
-	char *buf;		/* input buffer; NULL for stdin */
+	struct rstr *buf;	/* input buffer; NULL for stdin */
 	int pos;		/* current position in buf */
-	int unbuf[LNLEN];	/* push-back buffer */
-	int uncnt;
-	char *args[NARGS];	/* macro arguments */
+	int *unbuf;		/* push-back buffer; unbuf0 or allocated */
+	int unsz;		/* the size of unbuf */
+	int uncnt;		/* the number of characters in unbuf */
+	int unbuf0[NUNBUF];	/* inline push-back buffer */
+	struct rstr *args[NARGS];	/* macro arguments */
 	int call;		/* is a macro call */
+	int builtin;		/* buf is a built-in macro, not referenced */
 };
 
-static struct esrc esrc_stdin;	/* the default input stream */
-static struct esrc *esrc = &esrc_stdin;
-static int lineno = 1;		/* current line number */
-static int esrc_depth;		/* the length of esrc chain */
+/* wrap an allocated string; s is freed with the last reference */
+static struct rstr *rstr_wrap(char *s)
+{
+	struct rstr *r = malloc(sizeof(*r));
+	r->s = s;
+	r->ref = 1;
+	r->toks = NULL;
+	return r;
+}
 
-static char *src_strdup(char *s)
+static struct rstr *rstr_mk(char *s)
 {
 	char *d = malloc(strlen(s) + 1);
 	strcpy(d, s);
-	return d;
+	return rstr_wrap(d);
+}
+
+static struct rstr *rstr_get(struct rstr *r)
+{
+	if (r)
+		r->ref++;
+	return r;
+}
+
+static void rstr_put(struct rstr *r)
+{
+	if (r && !--r->ref) {
+		free(r->toks);
+		free(r->s);
+		free(r);
+	}
 }
 
-/* push buf in the input stream; this is a macro call if args is not NULL */
-static void src_push(char *buf, char **args)
+/*
+ * push buf in the input stream; the references in buf, unless builtin,
+ * and in args are taken, and released if it fails
+ */
+static void src_push(struct rstr *buf, struct rstr **args, int builtin)
 {
 	struct esrc *next;
 	int i;
-	if (esrc_depth > NSRCDEP)
+	if (ctx->esrc_depth > NSRCDEP) {
+		if (!builtin)
+			rstr_put(buf);
+		for (i = 0; args && i < NARGS; i++)
+			rstr_put(args[i]);
 		errdie("neateqn: macro recursion limit reached\n");
-	next = malloc(sizeof(*next));
-	memset(next, 0, sizeof(*next));
-	next->prev = esrc;
-	next->buf = src_strdup(buf);
+	}
+	if (ctx->esrc_free) {
+		next = ctx->esrc_free;
+		ctx->esrc_free = next->prev;
+	} else {
+		next = malloc(sizeof(*next));
+		next->unbuf = next->unbuf0;
+		next->unsz = NUNBUF;
+	}
+	next->prev = ctx->esrc;
+	next->buf = buf;
+	next->pos = 0;
+	next->uncnt = 0;
 	next->call = args != NULL;
-	if (args)
-		for (i = 0; i < NARGS; i++)
-			next->args[i] = args[i] ? src_strdup(args[i]) : NULL;
-	esrc = next;
-	esrc_depth++;
+	next->builtin = builtin;
+	for (i = 0; i < NARGS; i++)
+		next->args[i] = args ? args[i] : NULL;
+	ctx->esrc = next;
+	ctx->esrc_depth++;
+	ctx->esrc_gen++;
 }
 
 /* back to the previous esrc buffer */
 static void src_pop(void)
 {
-	struct esrc *prev = esrc->prev;
+	struct esrc *prev = ctx->esrc->prev;
 	int i;
 	if (prev) {
 		for (i = 0; i < NARGS; i++)
-			free(esrc->args[i]);
-		free(esrc->buf);
-		free(esrc);
-		esrc = prev;
-		esrc_depth--;
+			rstr_put(ctx->esrc->args[i]);
+		if (!ctx->esrc->builtin)
+			rstr_put(ctx->esrc->buf);
+		ctx->esrc->prev = ctx->esrc_free;
+		ctx->esrc_free = ctx->esrc;
+		ctx->esrc = prev;
+		ctx->esrc_depth--;
+		ctx->esrc_gen++;
+	}
+}
+
+/* count the newlines read since the last call */
+static void src_lines(void)
+{
+	char *s = ctx->ibuf + ctx->ibuf_lnpos;
+	char *e = ctx->ibuf + ctx->ibuf_pos;
+	while (s < e && (s = memchr(s, '\n', e - s))) {
+		ctx->lineno++;
+		s++;
+	}
+	ctx->ibuf_lnpos = MAX(ctx->ibuf_lnpos, ctx->ibuf_pos);
+}
+
+/* map the input file or read its next block; return the next character */
+static int src_fill(void)
+{
+	struct stat st;
+	int fd = ctx->ifd;
+	src_lines();
+	ctx->esrc_gen++;
+	if (ctx->ibuf_map || ctx->ibuf_ext)
+		return -1;
+	if (!ctx->ibuf) {
+		if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+			ctx->ibuf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ctx->ibuf != MAP_FAILED) {
+				madvise(ctx->ibuf, st.st_size, MADV_SEQUENTIAL);
+				ctx->ibuf_map = 1;
+				ctx->ibuf_len = st.st_size;
+				return (unsigned char) ctx->ibuf[ctx->ibuf_pos++];
+			}
+		}
+		ctx->ibuf = malloc(IBUFSZ);
+	}
+	ctx->ibuf_len = read(fd, ctx->ibuf, IBUFSZ);
+	ctx->ibuf_pos = 0;
+	ctx->ibuf_lnpos = 0;
+	if (ctx->ibuf_len <= 0) {
+		ctx->ibuf_len = 0;
+		return -1;
 	}
+	return (unsigned char) ctx->ibuf[ctx->ibuf_pos++];
+}
+
+/* release the input buffer */
+static void src_release(void)
+{
+	if (ctx->ibuf_map)
+		munmap(ctx->ibuf, ctx->ibuf_len);
+	else if (!ctx->ibuf_ext)
+		free(ctx->ibuf);
+	ctx->ibuf = NULL;
+	ctx->ibuf_len = 0;
+	ctx->ibuf_pos = 0;
+	ctx->ibuf_lnpos = 0;
+	ctx->ibuf_map = 0;
+	ctx->ibuf_ext = 0;
+	ctx->esrc_stdin->uncnt = 0;
+	ctx->lineno = 1;
 }
 
-static int src_stdin(void)
+/* read the input from file descriptor fd */
+void src_file(int fd)
 {
-	int c = fgetc(stdin);
-	if (c == '\n')
-		lineno++;
-	return c;
+	src_release();
+	ctx->ifd = fd;
+}
+
+/* read the input from the n bytes at s; s is not copied */
+void src_input(char *s, long n)
+{
+	src_release();
+	ctx->ibuf = s;
+	ctx->ibuf_len = n;
+	ctx->ibuf_ext = 1;
 }
 
 /* read the next character */
 int src_next(void)
 {
+	struct neateqn *eqn = ctx;
+	struct esrc *src;
 	while (1) {
-		if (esrc->uncnt)
-			return esrc->unbuf[--esrc->uncnt];
-		if (!esrc->prev)
-			return src_stdin();
-		if (esrc->buf[esrc->pos])
-			return (unsigned char) esrc->buf[esrc->pos++];
+		src = eqn->esrc;
+		if (src->uncnt)
+			return src->unbuf[--src->uncnt];
+		if (!src->prev) {
+			if (eqn->ibuf_pos < eqn->ibuf_len)
+				return (unsigned char) eqn->ibuf[eqn->ibuf_pos++];
+			return src_fill();
+		}
+		if (src->buf->s[src->pos])
+			return (unsigned char) src->buf->s[src->pos++];
 		src_pop();
 	}
 	return 0;
 }
 
-/* push back c */
+/* enlarge the push-back buffer of src */
+static void src_unbufgrow(struct esrc *src)
+{
+	int *unbuf;
+	if (!src->unbuf) {		/* esrc_stdin */
+		src->unbuf = src->unbuf0;
+		src->unsz = NUNBUF;
+		return;
+	}
+	unbuf = malloc(src->unsz * 2 * sizeof(unbuf[0]));
+	memcpy(unbuf, src->unbuf, src->uncnt * sizeof(unbuf[0]));
+	if (src->unbuf != src->unbuf0)
+		free(src->unbuf);
+	src->unbuf = unbuf;
+	src->unsz *= 2;
+}
+
+/* push back c; NULs and EOF are dropped */
 void src_back(int c)
 {
-	if (c > 0)
-		esrc->unbuf[esrc->uncnt++] = c;
+	if (c > 0) {
+		if (ctx->esrc->uncnt == ctx->esrc->unsz)
+			src_unbufgrow(ctx->esrc);
+		ctx->esrc->unbuf[ctx->esrc->uncnt++] = c;
+	}
+	ctx->esrc_gen++;	/* rewinding would restore dropped characters */
+}
+
+/* save the current position */
+void src_mark(struct spos *pos)
+{
+	pos->src = ctx->esrc;
+	pos->pos = ctx->esrc->prev ? ctx->esrc->pos : ctx->ibuf_pos;
+	pos->uncnt = ctx->esrc->uncnt;
+	pos->gen = ctx->esrc_gen;
+}
+
+/* return to a position saved by src_mark(); return nonzero on failure */
+int src_rewind(struct spos *pos)
+{
+	if (pos->src != ctx->esrc || pos->gen != ctx->esrc_gen)
+		return 1;
+	if (ctx->esrc->prev) {
+		ctx->esrc->pos = pos->pos;
+	} else {
+		src_lines();	/* count rewound lines only once */
+		ctx->ibuf_pos = pos->pos;
+	}
+	ctx->esrc->uncnt = pos->uncnt;
+	return 0;
+}
+
+/* the unread part of the current input block, if reading it directly */
+long src_span(char **s)
+{
+	if (ctx->esrc->prev || ctx->esrc->uncnt)
+		return 0;
+	if (ctx->ibuf_pos == ctx->ibuf_len) {
+		if (src_fill() < 0)
+			return 0;
+		ctx->ibuf_pos--;
+	}
+	*s = ctx->ibuf + ctx->ibuf_pos;
+	return ctx->ibuf_len - ctx->ibuf_pos;
+}
+
+/* the compiled token at the current position of a macro body */
+struct mtok *src_mtok(char **s)
+{
+	if (ctx->esrc->uncnt || !ctx->esrc->buf || !ctx->esrc->buf->toks)
+		return NULL;
+	*s = ctx->esrc->buf->s + ctx->esrc->pos;
+	return &ctx->esrc->buf->toks[ctx->esrc->pos];
+}
+
+/* skip n characters returned by src_mtok() or src_span() */
+void src_skip(long n)
+{
+	if (ctx->esrc->prev)
+		ctx->esrc->pos += n;
+	else
+		ctx->ibuf_pos += n;
 }
 
 int src_lineget(void)
 {
-	return lineno;
+	src_lines();
+	return ctx->lineno;
 }
 
 void src_lineset(int n)
 {
-	lineno = n;
+	src_lines();
+	ctx->lineno = n;
 }
 
-/* eqn macros */
+/* eqn macros, in an open-addressing hash table */
 struct macro {
-	char name[NMLEN];
-	char *def;
+	char *name;		/* macro name; allocated */
+	unsigned hash;		/* the hash of name */
+	struct rstr *def;	/* macro body; NULL for empty slots */
 };
-static struct macro macros[NMACROS];
-static int nmacros;
 
-static int src_findmacro(char *name)
+struct mtab {
+	struct macro *tab;	/* the hash table */
+	int sz;			/* table size; a power of two */
+	int n;			/* the number of defined macros */
+};
+
+static unsigned src_hash(char *s)
+{
+	unsigned h = 5381;
+	while (*s)
+		h = ((h << 5) + h) ^ (unsigned char) *s++;
+	return h;
+}
+
+/* the slot holding the given macro or the empty slot for inserting it */
+static struct macro *src_slot(struct mtab *mt, char *name, unsigned hash)
+{
+	int i = hash & (mt->sz - 1);
+	while (mt->tab[i].def) {
+		if (mt->tab[i].hash == hash && !strcmp(mt->tab[i].name, name))
+			return &mt->tab[i];
+		i = (i + 1) & (mt->sz - 1);
+	}
+	return &mt->tab[i];
+}
+
+/* find a macro; macros defined in the input hide built-in ones */
+static struct macro *src_findmacro(char *name, int *builtin)
+{
+	unsigned hash = src_hash(name);
+	struct macro *m = NULL;
+	*builtin = 0;
+	if (ctx->macros->n)
+		m = src_slot(ctx->macros, name, hash);
+	if ((!m || !m->def) && ctx->defs->n) {
+		m = src_slot(ctx->defs, name, hash);
+		*builtin = 1;
+	}
+	return m && m->def ? m : NULL;
+}
+
+/* double the size of the hash table */
+static void src_grow(struct mtab *mt)
 {
+	struct macro *old = mt->tab;
+	int old_sz = mt->sz;
 	int i;
-	for (i = 0; i < nmacros; i++)
-		if (!strcmp(macros[i].name, name))
-			return i;
-	return -1;
+	mt->sz = mt->sz ? mt->sz * 2 : 256;
+	mt->tab = malloc(mt->sz * sizeof(mt->tab[0]));
+	memset(mt->tab, 0, mt->sz * sizeof(mt->tab[0]));
+	for (i = 0; i < old_sz; i++)
+		if (old[i].def)
+			memcpy(src_slot(mt, old[i].name, old[i].hash),
+				&old[i], sizeof(old[i]));
+	free(old);
+}
+
+static void src_put(struct mtab *mt, char *name, char *def)
+{
+	unsigned hash = src_hash(name);
+	struct macro *m;
+	if ((mt->n + 1) * 2 > mt->sz)
+		src_grow(mt);
+	m = src_slot(mt, name, hash);
+	if (!m->def) {
+		m->name = malloc(strlen(name) + 1);
+		strcpy(m->name, name);
+		m->hash = hash;
+		mt->n++;
+	}
+	rstr_put(m->def);
+	m->def = rstr_mk(def);
+	m->def->toks = tok_compile(def);
+}
+
+static void src_free(struct mtab *mt)
+{
+	int i;
+	for (i = 0; i < mt->sz; i++) {
+		rstr_put(mt->tab[i].def);
+		free(mt->tab[i].name);
+	}
+	free(mt->tab);
+	free(mt);
 }
 
 /* return nonzero if name is a macro */
 int src_macro(char *name)
 {
-	return src_findmacro(name) >= 0;
+	int builtin;
+	return src_findmacro(name, &builtin) != NULL;
 }
 
 /* define a macro */
 void src_define(char *name, char *def)
 {
-	int idx = src_findmacro(name);
-	if (idx < 0 && nmacros < NMACROS)
-		idx = nmacros++;
-	if (idx >= 0) {
-		strcpy(macros[idx].name, name);
-		free(macros[idx].def);
-		macros[idx].def = src_strdup(def);
+	src_put(ctx->macros, name, def);
+}
+
+/* initialize the input; the built-in macros of base are used if not NULL */
+void src_init(struct neateqn *base)
+{
+	int i;
+	ctx->esrc_stdin = calloc(1, sizeof(*ctx->esrc_stdin));
+	ctx->esrc = ctx->esrc_stdin;
+	ctx->lineno = 1;
+	ctx->macros = calloc(1, sizeof(*ctx->macros));
+	if (base) {
+		ctx->defs = base->defs;
+		ctx->defs_shared = 1;
+		return;
 	}
+	ctx->defs = calloc(1, sizeof(*ctx->defs));
+	for (i = 0; def_macros[i][0]; i++)
+		src_put(ctx->defs, def_macros[i][0], def_macros[i][1]);
 }
 
 void src_done(void)
 {
-	int i;
-	for (i = 0; i < nmacros; i++)
-		free(macros[i].def);
+	struct esrc *src;
+	while (ctx->esrc->prev)
+		src_pop();
+	while ((src = ctx->esrc_free)) {
+		ctx->esrc_free = src->prev;
+		if (src->unbuf != src->unbuf0)
+			free(src->unbuf);
+		free(src);
+	}
+	if (ctx->esrc_stdin->unbuf != ctx->esrc_stdin->unbuf0)
+		free(ctx->esrc_stdin->unbuf);
+	src_free(ctx->macros);
+	if (!ctx->defs_shared)
+		src_free(ctx->defs);
+	src_release();
+	free(ctx->esrc_stdin);
 }
 
-/* expand macro */
+/* expand macro; args are allocated strings, which are freed by src */
 int src_expand(char *name, char **args)
 {
-	int i = src_findmacro(name);
-	if (i >= 0)
-		src_push(macros[i].def, args);
-	return i < 0;
+	struct rstr *rargs[NARGS] = {NULL};
+	int builtin;
+	struct macro *m = src_findmacro(name, &builtin);
+	int i;
+	for (i = 0; i < NARGS; i++)
+		rargs[i] = args[i] ? rstr_wrap(args[i]) : NULL;
+	if (m) {
+		src_push(builtin ? m->def : rstr_get(m->def), rargs, builtin);
+	} else {
+		for (i = 0; i < NARGS; i++)
+			rstr_put(rargs[i]);
+	}
+	return m == NULL;
 }
 
 /* expand argument */
 int src_arg(int i)
 {
-	int call = esrc->call;
-	if (call && esrc->args[i - 1])
-		src_push(esrc->args[i - 1], NULL);
+	int call = ctx->esrc->call;
+	if (call && ctx->esrc->args[i - 1])
+		src_push(rstr_get(ctx->esrc->args[i - 1]), NULL, 0);
 	return call ? 0 : 1;
 }
 
 /* return one if not reading macros and their arguments */
 int src_top(void)
 {
-	return !esrc->prev;
+	return !ctx->esrc->prev;
 }
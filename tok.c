@@ -1,15 +1,22 @@
 /* the preprocessor and tokenizer */
-#include <ctype.h>
-#include <stdio.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "eqn.h"
 
 #define T_BIN(c1, c2)		(((c1) << 8) | (c2))
-#define T_SOFTSEP		("^~{}(),\"\n\t =:|.+-*/\\,()[]<>!")
+#define NEXPAND		512	/* macro expansions while reading a token */
 #define ESAVE		"\\E*[.eqnbeg]\\R'" EQNFN "0 \\En(.f'\\R'" EQNSZ "0 \\En(.s'"
 #define ELOAD		"\\f[\\En[" EQNFN "0]]\\s[\\En[" EQNSZ "0]]\\E*[.eqnend]"
 
+/* keywords, indexed by K_* identifiers */
 static char *kwds[] = {
 	"fwd", "down", "back", "up",
 	"bold", "italic", "roman", "font", "fat", "size",
@@ -18,32 +25,43 @@ static char *kwds[] = {
 	"left", "right", "over", "sqrt",
 	"pile", "lpile", "cpile", "rpile", "above",
 	"matrix", "col", "ccol", "lcol", "rcol",
+	"mark", "lineup",
 	"delim", "define",
 	"gfont", "grfont", "gbfont", "gsize", "set", "chartype",
-	"mark", "lineup", "bracketsizes", "bracketpieces", "breakcost",
+	"bracketsizes", "bracketpieces", "breakcost",
+	"{", "}", "~", "^", "\t",
 };
 
-static int tok_eqen;		/* non-zero if inside .EQ/.EN */
-static int tok_line;		/* inside inline eqn block */
-static int tok_part;		/* partial line with inline eqn blocks */
-static char tok[LNLEN];		/* current token */
-static char tok_prev[LNLEN];	/* previous token */
-static int tok_curtype;		/* type of current token */
-static int tok_cursep;		/* current character is a separator */
-static int tok_prevsep;		/* previous character was a separator */
-static int eqn_beg, eqn_end;	/* inline eqn delimiters */
+/*
+ * Keyword identifiers plus one, indexed by kwd_hash(); zero for empty
+ * slots.  The multiplier in kwd_hash() is chosen so that no two words
+ * of kwds[] before K_LBRACE share a slot; both must be regenerated if
+ * the keywords change.
+ */
+static unsigned char kwds_tab[128] = {
+	17, 0, 0, 0, 10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 39,
+	0, 0, 0, 18, 0, 0, 24, 0, 34, 0, 0, 0, 0, 0, 0, 0,
+	15, 22, 5, 0, 0, 36, 19, 26, 0, 0, 50, 43, 14, 0, 11, 0,
+	21, 16, 0, 0, 0, 0, 32, 3, 40, 0, 0, 35, 0, 33, 23, 0,
+	0, 4, 0, 0, 0, 2, 20, 0, 29, 0, 0, 47, 0, 13, 0, 45,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 25, 42, 0, 27, 41,
+	0, 0, 9, 0, 31, 0, 7, 0, 0, 6, 0, 0, 8, 0, 0, 28,
+	12, 0, 49, 1, 0, 46, 0, 0, 0, 0, 44, 48, 0, 30, 37, 38,
+};
 
 /* return zero if troff request .ab is read */
 static int tok_req(int a, int b)
 {
+	struct spos pos;
 	int eqln[LNLEN];
 	int i = 0;
 	int ret = 0;
+	src_mark(&pos);
 	eqln[i++] = src_next();
 	if (eqln[i - 1] != '.')
 		goto failed;
 	eqln[i++] = src_next();
-	while (eqln[i - 1] == ' ' && i < sizeof(eqln) - 4)
+	while (eqln[i - 1] == ' ' && i < LEN(eqln) - 4)
 		eqln[i++] = src_next();
 	if (eqln[i - 1] != a)
 		goto failed;
@@ -52,8 +70,9 @@ static int tok_req(int a, int b)
 		goto failed;
 	ret = 1;
 failed:
-	while (i > 0)
-		src_back(eqln[--i]);
+	if (eqln[i - 1] <= 0 || src_rewind(&pos))
+		while (i > 0)
+			src_back(eqln[--i]);
 	return ret;
 }
 
@@ -68,7 +87,7 @@ static int tok_eq(char *s)
 {
 	if (*s++ != '.')
 		return 0;
-	while (isspace((unsigned char) *s))
+	while (def_class(*s) & C_SPACE)
 		s++;
 	return s[0] == 'E' && s[1] == 'Q';
 }
@@ -78,13 +97,13 @@ static int tok_lf(char *s)
 {
 	if (*s++ != '.')
 		return 0;
-	while (isspace((unsigned char) *s))
+	while (def_class(*s) & C_SPACE)
 		s++;
 	if (*s++ != 'l' || *s++ != 'f')
 		return 0;
-	while (isspace((unsigned char) *s))
+	while (def_class(*s) & C_SPACE)
 		s++;
-	if (isdigit((unsigned char) *s))
+	if (def_class(*s) & C_DIGIT)
 		src_lineset(atoi(s));
 	return 1;
 }
@@ -93,13 +112,13 @@ static int tok_lf(char *s)
 static int tok_next(void)
 {
 	int c;
-	if (!tok_eqen && !tok_line)
+	if (!ctx->tok_eqen && !ctx->tok_line)
 		return 0;
 	c = src_next();
-	if (tok_eqen && c == '\n' && tok_en())
-		tok_eqen = 0;
-	if (tok_line && (src_top() && c == eqn_end)) {
-		tok_line = 0;
+	if (ctx->tok_eqen && c == '\n' && tok_en())
+		ctx->tok_eqen = 0;
+	if (ctx->tok_line && (src_top() && c == ctx->eqn_end)) {
+		ctx->tok_line = 0;
 		return 0;
 	}
 	return c;
@@ -108,46 +127,63 @@ static int tok_next(void)
 /* push back the last character read */
 static void tok_back(int c)
 {
-	if (tok_eqen || tok_line)
+	if (ctx->tok_eqen || ctx->tok_line)
 		src_back(c);
 }
 
-/* read the next word */
-static void tok_preview(char *s)
+/* undo reading c, which was read by tok_next() after src_mark(pos) */
+static void tok_unread(struct spos *pos, int c)
 {
-	int c = src_next();
-	int n = 0;
+	if ((ctx->tok_eqen || ctx->tok_line) && (c <= 0 || src_rewind(pos)))
+		src_back(c);
+}
+
+/* read the next word into sb */
+static void tok_preview(struct sbuf *sb)
+{
+	struct spos pos;
+	int c;
+	sbuf_cut(sb, 0);
+	src_mark(&pos);
+	c = src_next();
 	if (c > 0 && def_chopped(c)) {
-		s[n++] = c;
-		s[n] = '\0';
+		sbuf_add(sb, c);
 		return;
 	}
-	while (c > 0 && !def_chopped(c) && (!tok_line || (!src_top() || c != eqn_end))) {
-		s[n++] = c;
+	while (c > 0 && !def_chopped(c) &&
+			(!ctx->tok_line || !src_top() || c != ctx->eqn_end)) {
+		sbuf_add(sb, c);
+		src_mark(&pos);
 		c = src_next();
 	}
-	s[n] = '\0';
-	src_back(c);
+	if (c <= 0 || src_rewind(&pos))
+		src_back(c);
 }
 
-/* push back the given word */
-static void tok_unpreview(char *s)
+/* undo reading word sb, which was read after src_mark(pos) */
+static void tok_unpreview(struct spos *pos, struct sbuf *sb)
 {
-	int n = strlen(s);
-	while (n > 0)
-		src_back((unsigned char) s[--n]);
+	char *s = sbuf_buf(sb);
+	int n = sbuf_len(sb);
+	if (src_rewind(pos))
+		while (n > 0)
+			src_back((unsigned char) s[--n]);
 }
 
-/* read a keyword; return zero on success */
-static int tok_keyword(void)
+/* a perfect hash for keywords; see kwds_tab[] */
+static int kwd_hash(char *s)
 {
-	int i;
-	tok_preview(tok);
-	for (i = 0; i < LEN(kwds); i++)
-		if (!strcmp(kwds[i], tok))
-			return 0;
-	tok_unpreview(tok);
-	return 1;
+	unsigned h = 5381;
+	while (*s)
+		h = ((h << 5) + h) ^ (unsigned char) *s++;
+	return ((h * 0x1feea70fu) & 0xffffffffu) >> 25;
+}
+
+/* return the identifier of keyword s or -1 */
+static int kwd_id(char *s)
+{
+	int k = kwds_tab[kwd_hash(s)] - 1;
+	return k >= 0 && !strcmp(kwds[k], s) ? k : -1;
 }
 
 /* read the next argument of a macro call; return zero if read a ',' */
@@ -181,67 +217,134 @@ static int tok_readarg(struct sbuf *sbuf)
 	return c == ',' ? 0 : 1;
 }
 
-/* expand a macro; return zero on success */
+/* expand the macro whose name was just read into tok; return zero on success */
 static int tok_expand(void)
 {
 	char *args[10] = {NULL};
 	struct sbuf sbufs[10];
+	struct spos pos;
 	int i, n = 0;
-	tok_preview(tok);
-	if (src_macro(tok)) {
-		int c = src_next();
-		src_back(c);
+	if (src_macro(sbuf_buf(&ctx->tok))) {
+		int c;
+		src_mark(&pos);
+		c = src_next();
 		if (c == '(') {		/* macro arguments follow */
-			src_next();
 			while (n <= 9) {
 				sbuf_init(&sbufs[n]);
 				if (tok_readarg(&sbufs[n++]))
 					break;
 			}
+		} else if (c <= 0 || src_rewind(&pos)) {
+			src_back(c);
 		}
-		for (i = 0; i < n; i++)
+		for (i = 0; i < n; i++)		/* src_expand() frees them */
 			args[i] = sbuf_buf(&sbufs[i]);
-		src_expand(tok, args);
-		for (i = 0; i < n; i++)
-			sbuf_done(&sbufs[i]);
+		src_expand(sbuf_buf(&ctx->tok), args);
 		return 0;
 	}
-	tok_unpreview(tok);
 	return 1;
 }
 
+/* s[i] is a newline, eqn_beg or NUL; return nonzero if tok_plain() should stop */
+static int tok_plainstop(char *s, long n, long i, long *ln)
+{
+	if (s[i] != '\n')
+		return 1;
+	*ln = i + 1;
+	return *ln < n && s[*ln] == '.';
+}
+
+/*
+ * Return the length of the complete lines at the start of s (n bytes)
+ * that tok_eqn() would copy unchanged: lines that do not start with a
+ * period and contain neither eqn_beg nor NUL characters.
+ */
+static long tok_plain(char *s, long n)
+{
+	long ln = 0;		/* the end of the last complete line */
+	long i = 0;
+	unsigned m;
+	if (n > 0 && s[0] == '.')
+		return 0;
+#ifdef __AVX2__
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((void *) (s + i));
+		m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ctx->eqn_beg))),
+			_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+		for (; m; m &= m - 1)
+			if (tok_plainstop(s, n, i + __builtin_ctz(m), &ln))
+				return ln;
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((void *) (s + i));
+		m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(ctx->eqn_beg))),
+			_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+		for (; m; m &= m - 1)
+			if (tok_plainstop(s, n, i + __builtin_ctz(m), &ln))
+				return ln;
+	}
+#endif
+	for (; i < n; i++) {
+		m = (unsigned char) s[i];
+		if ((m == '\n' || m == ctx->eqn_beg || !m) && tok_plainstop(s, n, i, &ln))
+			return ln;
+	}
+	return ln;
+}
+
+/* copy the lines that need no processing to the output */
+static void tok_copy(void)
+{
+	char *s;
+	long n = src_span(&s);
+	if (n > 0 && ctx->eqn_beg != '\n' && (n = tok_plain(s, n)) > 0) {
+		out_mem(s, n);
+		src_skip(n);
+	}
+}
+
 /* read until .EQ or eqn_beg */
 int tok_eqn(void)
 {
 	struct sbuf ln;
 	int c;
-	tok_cursep = 1;
+	ctx->tok_cursep = 1;
 	sbuf_init(&ln);
-	while ((c = src_next()) > 0) {
-		if (c == eqn_beg) {
-			printf(".eo\n");
-			printf(".%s %s \"%s\n",
-				tok_part ? "as" : "ds", EQNS, sbuf_buf(&ln));
+	while (1) {
+		if (!ctx->tok_part && sbuf_empty(&ln))
+			tok_copy();
+		if ((c = src_next()) <= 0)
+			break;
+		if (c == ctx->eqn_beg) {
+			out(".eo\n");
+			out(".%s %s \"%s\n",
+				ctx->tok_part ? "as" : "ds", EQNS, sbuf_buf(&ln));
 			sbuf_done(&ln);
-			printf(".ec\n");
-			tok_part = 1;
-			tok_line = 1;
+			out(".ec\n");
+			ctx->tok_part = 1;
+			ctx->tok_line = 1;
 			return 0;
 		}
 		sbuf_add(&ln, c);
-		if (c == '\n' && !tok_part) {
-			printf("%s", sbuf_buf(&ln));
+		if (c == '\n' && !ctx->tok_part) {
+			out_append(sbuf_buf(&ln));
 			tok_lf(sbuf_buf(&ln));
 			if (tok_eq(sbuf_buf(&ln)) && !tok_en()) {
-				tok_eqen = 1;
+				ctx->tok_eqen = 1;
 				sbuf_done(&ln);
 				return 0;
 			}
 		}
-		if (c == '\n' && tok_part) {
-			printf(".lf %d\n", src_lineget());
-			printf("\\*%s%s", escarg(EQNS), sbuf_buf(&ln));
-			tok_part = 0;
+		if (c == '\n' && ctx->tok_part) {
+			out(".lf %d\n", src_lineget());
+			out("\\*%s%s", escarg(EQNS), sbuf_buf(&ln));
+			ctx->tok_part = 0;
 		}
 		if (c == '\n')
 			sbuf_cut(&ln, 0);
@@ -253,12 +356,12 @@ int tok_eqn(void)
 /* collect the output of this eqn block */
 void tok_eqnout(char *s)
 {
-	if (!tok_part) {
-		printf(".ds %s \"%s%s%s\n", EQNS, ESAVE, s, ELOAD);
-		printf(".lf %d\n", src_lineget() - 1);
-		printf("\\&\\*%s\n", escarg(EQNS));
+	if (!ctx->tok_part) {
+		out(".ds %s \"%s%s%s\n", EQNS, ESAVE, s, ELOAD);
+		out(".lf %d\n", src_lineget() - 1);
+		out("\\&\\*%s\n", escarg(EQNS));
 	} else {
-		printf(".as %s \"%s%s%s\n", EQNS, ESAVE, s, ELOAD);
+		out(".as %s \"%s%s%s\n", EQNS, ESAVE, s, ELOAD);
 	}
 }
 
@@ -282,86 +385,244 @@ static int utf8len(int c)
 static int char_type(char *s)
 {
 	int c = (unsigned char) s[0];
+	int cls = def_class(c);
 	int t;
-	if (isdigit(c))
+	if (cls & C_DIGIT)
 		return T_NUMBER;
 	if (c == '"')
 		return T_STRING;
-	if ((t = def_type(s)) >= 0)
+	if ((cls & C_TYPED) && (t = def_type(s)) >= 0)
 		return t;
 	if (c == '~' || c == '^')
 		return T_GAP;
-	if (ispunct(c) && (c != '\\' || !s[1]))
+	if ((cls & C_PUNCT) && (c != '\\' || !s[1]))
 		return T_ORD;
 	return T_LETTER;
 }
 
-/* read the next token */
-static int tok_read(void)
+/* return nonzero if c1 and c2 form a two-character operator */
+static int tok_bin(int c1, int c2)
+{
+	switch (T_BIN(c1, c2)) {
+	case T_BIN('<', '='):
+	case T_BIN('>', '='):
+	case T_BIN('=', '='):
+	case T_BIN('!', '='):
+	case T_BIN('>', '>'):
+	case T_BIN('<', '<'):
+	case T_BIN(':', '='):
+	case T_BIN('-', '>'):
+	case T_BIN('<', '-'):
+	case T_BIN('-', '+'):
+		return 1;
+	}
+	return 0;
+}
+
+/* the word read by tok_preview() for keyword and macro probes from s (n bytes) */
+static void mtok_word(struct mtok *t, char *s, int n)
+{
+	char w[NMLEN];
+	int c = (unsigned char) s[0];
+	int len = 1;
+	/* $n or a character read with tok_next() may follow */
+	if (c == '$' && (n < 2 || s[1] == '\n' || (s[1] >= '1' && s[1] <= '9')))
+		return;
+	if (!def_chopped(c)) {
+		while (len < n && !def_chopped((unsigned char) s[len]))
+			len++;
+		if (len == n)		/* the word may continue after the body */
+			return;
+	}
+	if (len < sizeof(w)) {
+		memcpy(w, s, len);
+		w[len] = '\0';
+		t->wlen = len;
+		t->kwd = kwd_id(w);
+	}
+}
+
+/* the token read by tok_read() from s (n bytes), if read from s alone */
+static void mtok_tok(struct mtok *t, char *s, int n)
+{
+	char text[LNLEN];
+	int c = (unsigned char) s[0];
+	char *r;
+	int len = 1, toklen = 1;
+	int i;
+	if (c == ' ' || c == '\n') {
+		while (len < n && (s[len] == ' ' || s[len] == '\n'))
+			len++;
+		if (len == n || memchr(s, '\n', len))
+			return;
+	} else if (c == '\\') {
+		if (n < 2 || s[1] == '\n')
+			return;
+		if (s[1] == '(') {
+			if (n < 4 || memchr(s + 2, '\n', 2))
+				return;
+			len = toklen = 4;
+		} else if (s[1] == '[') {
+			if (!(r = memchr(s, ']', n)) || memchr(s, '\n', r - s))
+				return;
+			len = toklen = r - s + 1;
+		} else {
+			len = 2;
+		}
+	} else if (c == '"') {
+		for (i = 1; i < n && s[i] != '"'; i++)
+			if (s[i] == '\n' || (s[i] == '\\' &&
+					(i + 1 == n || s[i + 1] == '"' || s[i + 1] == '\n')))
+				return;
+		if (i == n)
+			return;
+		len = toklen = i + 1;
+	} else if (c != '\t' && (def_class(c) & C_SOFTSEP)) {
+		if (n < 2 || s[1] == '\n')
+			return;
+		len = toklen = tok_bin(c, (unsigned char) s[1]) ? 2 : 1;
+	} else if (c != '\t') {
+		len = toklen = utf8len(c);
+		if (len > n || memchr(s, '\n', len))
+			return;
+	}
+	if (toklen >= LNLEN - 2)
+		return;
+	t->len = len;
+	t->toklen = toklen;
+	t->typegen = def_typegen();
+	if (c == ' ' || c == '\t') {
+		t->type = c == ' ' ? T_SPACE : T_TAB;
+	} else {
+		memcpy(text, s, toklen);
+		text[toklen] = '\0';
+		t->type = char_type(text);
+	}
+}
+
+/* compile macro body s; tok_replay() reads its tokens */
+struct mtok *tok_compile(char *s)
+{
+	int n = strlen(s);
+	struct mtok *toks = malloc((n + 1) * sizeof(toks[0]));
+	int i;
+	memset(toks, 0, (n + 1) * sizeof(toks[0]));
+	for (i = 0; i < n; i++) {
+		toks[i].kwd = -1;
+		mtok_word(&toks[i], s + i, n - i);
+		mtok_tok(&toks[i], s + i, n - i);
+	}
+	return toks;
+}
+
+/* read the next token from a compiled macro body; return zero on success */
+static int tok_replay(void)
+{
+	struct mtok *t;
+	char *s;
+	int sep;
+	if ((!ctx->tok_eqen && !ctx->tok_line) || !(t = src_mtok(&s)) || !t->len)
+		return 1;
+	sep = ctx->tok_cursep || def_chopped((unsigned char) s[0]);
+	if (sep && s[0] != ' ' && s[0] != '\t') {
+		if (!t->wlen)
+			return 1;
+		sbuf_mem(&ctx->tok, s, t->wlen);
+		if (t->kwd >= 0) {
+			src_skip(t->wlen);
+			ctx->tok_prevsep = 1;
+			ctx->tok_cursep = 1;
+			ctx->tok_curtype = T_KEYWORD;
+			ctx->tok_curkwd = t->kwd;
+			return 0;
+		}
+		if (src_macro(sbuf_buf(&ctx->tok)))
+			return 1;
+		sbuf_cut(&ctx->tok, 0);
+	}
+	sbuf_mem(&ctx->tok, s, t->toklen);
+	src_skip(t->len);
+	ctx->tok_prevsep = sep;
+	ctx->tok_cursep = def_chopped((unsigned char) s[0]);
+	if (t->typegen == def_typegen() || t->type == T_SPACE || t->type == T_TAB)
+		ctx->tok_curtype = t->type;
+	else
+		ctx->tok_curtype = char_type(sbuf_buf(&ctx->tok));
+	return 0;
+}
+
+/* read the next token; return -1 if it should be read again */
+static int tok_readone(void)
 {
-	char *s = tok;
-	char *e = tok + sizeof(tok) - 2;
+	struct spos beg, pos;
 	int c, c2;
 	int i;
-	*s = '\0';
+	sbuf_cut(&ctx->tok, 0);
+	if (!tok_replay())
+		return 0;
+	sbuf_cut(&ctx->tok, 0);
+	src_mark(&beg);
 	c = tok_next();
 	if (c <= 0)
 		return 1;
-	tok_prevsep = tok_cursep;
-	tok_cursep = def_chopped(c);
-	if (tok_cursep)
-		tok_prevsep = 1;
+	ctx->tok_prevsep = ctx->tok_cursep;
+	ctx->tok_cursep = def_chopped(c);
+	if (ctx->tok_cursep)
+		ctx->tok_prevsep = 1;
 	if (c == ' ' || c == '\n') {
 		while (c > 0 && (c == ' ' || c == '\n'))
 			c = tok_next();
 		tok_back(c);
-		*s++ = ' ';
-		*s = '\0';
-		tok_curtype = T_SPACE;
+		sbuf_add(&ctx->tok, ' ');
+		ctx->tok_curtype = T_SPACE;
 		return 0;
 	}
 	if (c == '\t') {
-		*s++ = '\t';
-		*s = '\0';
-		tok_curtype = T_TAB;
+		sbuf_add(&ctx->tok, '\t');
+		ctx->tok_curtype = T_TAB;
 		return 0;
 	}
-	if (tok_prevsep) {
+	if (ctx->tok_prevsep) {
 		if (c == '$') {
+			src_mark(&pos);
 			c2 = tok_next();
 			if (c2 >= '1' && c2 <= '9' && !src_arg(c2 - '0')) {
-				tok_cursep = 1;
-				return tok_read();
+				ctx->tok_cursep = 1;
+				return -1;
 			}
-			tok_back(c2);
+			tok_unread(&pos, c2);
 		}
-		tok_back(c);
-		if (!tok_keyword()) {
-			tok_curtype = T_KEYWORD;
-			tok_cursep = 1;
+		/* probe for keywords and macros, reading the word once */
+		tok_unread(&beg, c);
+		src_mark(&beg);
+		tok_preview(&ctx->tok);
+		if ((ctx->tok_curkwd = kwd_id(sbuf_buf(&ctx->tok))) >= 0) {
+			ctx->tok_curtype = T_KEYWORD;
+			ctx->tok_cursep = 1;
 			return 0;
 		}
 		if (!tok_expand()) {
-			tok_cursep = 1;
-			return tok_read();
+			ctx->tok_cursep = 1;
+			return -1;
 		}
+		tok_unpreview(&beg, &ctx->tok);
+		sbuf_cut(&ctx->tok, 0);
 		c = tok_next();
 	}
-	if (strchr(T_SOFTSEP, c)) {
-		*s++ = c;
+	if (def_class(c) & C_SOFTSEP) {
+		sbuf_add(&ctx->tok, c);
 		if (c == '\\') {
 			c = tok_next();
 			if (c == '(') {
-				*s++ = c;
-				*s++ = tok_next();
-				*s++ = tok_next();
+				sbuf_add(&ctx->tok, c);
+				sbuf_add(&ctx->tok, tok_next());
+				sbuf_add(&ctx->tok, tok_next());
 			} else if (c == '[') {
-				while (c && c != ']') {
-					if (s < e)
-						*s++ = c;
+				while (c > 0 && c != ']') {
+					sbuf_add(&ctx->tok, c);
 					c = tok_next();
 				}
-				*s++ = ']';
+				sbuf_add(&ctx->tok, ']');
 			}
 		} else if (c == '"') {
 			c = tok_next();
@@ -373,72 +634,78 @@ static int tok_read(void)
 					else
 						tok_back(c2);
 				}
-				if (s < e)
-					*s++ = c;
+				sbuf_add(&ctx->tok, c);
 				c = tok_next();
 			}
-			*s++ = '"';
+			sbuf_add(&ctx->tok, '"');
 		} else {
 			/* two-character operators */
 			c2 = tok_next();
-			switch (T_BIN(c, c2)) {
-			case T_BIN('<', '='):
-			case T_BIN('>', '='):
-			case T_BIN('=', '='):
-			case T_BIN('!', '='):
-			case T_BIN('>', '>'):
-			case T_BIN('<', '<'):
-			case T_BIN(':', '='):
-			case T_BIN('-', '>'):
-			case T_BIN('<', '-'):
-			case T_BIN('-', '+'):
-				*s++ = c2;
-				break;
-			default:
+			if (tok_bin(c, c2))
+				sbuf_add(&ctx->tok, c2);
+			else
 				tok_back(c2);
-			}
 		}
-		*s = '\0';
-		tok_curtype = char_type(tok);
+		ctx->tok_curtype = char_type(sbuf_buf(&ctx->tok));
 		return 0;
 	}
-	*s++ = c;
+	sbuf_add(&ctx->tok, c);
 	i = utf8len(c);
-	while (--i > 0 && s < e)
-		*s++ = tok_next();
-	*s = '\0';
-	tok_curtype = char_type(tok);
+	while (--i > 0)
+		sbuf_add(&ctx->tok, tok_next());
+	ctx->tok_curtype = char_type(sbuf_buf(&ctx->tok));
 	return 0;
 }
 
+/*
+ * read the next token; macros expanding to themselves at their end do
+ * not nest, so their expansions are counted here
+ */
+static int tok_read(void)
+{
+	int ret, n = 0;
+	while ((ret = tok_readone()) < 0)
+		if (++n > NEXPAND)
+			errdie("neateqn: macro recursion limit reached\n");
+	return ret;
+}
+
+/* the token in sb or NULL if it is empty */
+static char *tok_str(struct sbuf *sb)
+{
+	return sbuf_len(sb) && sbuf_buf(sb)[0] ? sbuf_buf(sb) : NULL;
+}
+
 /* current token */
 char *tok_get(void)
 {
-	return tok[0] ? tok : NULL;
+	return tok_str(&ctx->tok);
 }
 
 /* current token type */
 int tok_type(void)
 {
-	return tok[0] ? tok_curtype : 0;
+	return tok_str(&ctx->tok) ? ctx->tok_curtype : 0;
 }
 
 /* return nonzero if current token chops the equation */
 int tok_chops(int soft)
 {
-	if (!tok_get() || tok_curtype == T_KEYWORD)
+	if (!tok_get() || ctx->tok_curtype == T_KEYWORD)
 		return 1;
 	if (soft)
-		return strchr(T_SOFTSEP, (unsigned char) tok_get()[0]) != NULL ;
+		return (def_class(tok_get()[0]) & C_SOFTSEP) != 0;
 	return def_chopped((unsigned char) tok_get()[0]);
 }
 
 /* read the next token, return the previous */
 char *tok_pop(void)
 {
-	strcpy(tok_prev, tok);
+	struct sbuf t = ctx->tok_prev;	/* swap the buffers */
+	ctx->tok_prev = ctx->tok;
+	ctx->tok = t;
 	tok_read();
-	return tok_prev[0] ? tok_prev : NULL;
+	return tok_str(&ctx->tok_prev);
 }
 
 /* like tok_pop() but ignore T_SPACE tokens; if sep, read until chopped */
@@ -446,12 +713,13 @@ char *tok_poptext(int sep)
 {
 	while (tok_type() == T_SPACE)
 		tok_read();
-	tok_prev[0] = '\0';
+	sbuf_cut(&ctx->tok_prev, 0);
 	do {
-		strcat(tok_prev, tok);
+		if (tok_str(&ctx->tok))
+			sbuf_append(&ctx->tok_prev, tok_str(&ctx->tok));
 		tok_read();
-	} while (tok[0] && !tok_chops(!sep));
-	return tok_prev[0] ? tok_prev : NULL;
+	} while (tok_str(&ctx->tok) && !tok_chops(!sep));
+	return tok_str(&ctx->tok_prev);
 }
 
 /* skip spaces */
@@ -461,32 +729,51 @@ static void tok_blanks(void)
 		tok_pop();
 }
 
-/* if the next token is s, return zero and skip it */
-int tok_jmp(char *s)
+/* return the keyword identifier of the next non-blank token or -1 */
+int tok_kwd(void)
 {
+	char *s;
 	tok_blanks();
-	if (tok_get() && !s[1] && strchr("{}~^\t", s[0]) && !strcmp(s, tok_get())) {
-		tok_pop();
-		return 0;
-	}
-	if (tok_type() != T_KEYWORD || !tok_get() || strcmp(s, tok_get()))
+	if (!(s = tok_get()))
+		return -1;
+	if (ctx->tok_curtype == T_KEYWORD)
+		return ctx->tok_curkwd;
+	if (!s[1] && (s = strchr("{}~^\t", s[0])))
+		return K_LBRACE + (s - "{}~^\t");
+	return -1;
+}
+
+/* if the next token is keyword kwd, return zero and skip it */
+int tok_jmp(int kwd)
+{
+	if (tok_kwd() != kwd)
 		return 1;
 	tok_pop();
 	return 0;
 }
 
+/* the name of the given keyword */
+char *tok_kwdname(int kwd)
+{
+	return kwds[kwd];
+}
+
 /* read delim command */
 void tok_delim(void)
 {
-	char delim[NMLEN];
-	tok_preview(delim);
+	struct sbuf sb;
+	char *delim;
+	sbuf_init(&sb);
+	tok_preview(&sb);
+	delim = sbuf_buf(&sb);
 	if (!strcmp("off", delim)) {
-		eqn_beg = 0;
-		eqn_end = 0;
+		ctx->eqn_beg = 0;
+		ctx->eqn_end = 0;
 	} else {
-		eqn_beg = delim[0];
-		eqn_end = delim[1];
+		ctx->eqn_beg = delim[0];
+		ctx->eqn_end = delim[0] ? delim[1] : 0;
 	}
+	sbuf_done(&sb);
 }
 
 /* read macro definition */
@@ -495,7 +782,7 @@ static void tok_macrodef(struct sbuf *def)
 	int c;
 	int delim;
 	c = src_next();
-	while (c > 0 && isspace(c))
+	while (c > 0 && (def_class(c) & C_SPACE))
 		c = src_next();
 	delim = c;
 	c = src_next();
@@ -508,17 +795,24 @@ static void tok_macrodef(struct sbuf *def)
 /* read the next macro command */
 void tok_macro(void)
 {
-	char name[NMLEN];
-	struct sbuf def;
-	tok_preview(name);
+	struct sbuf name, def;
+	sbuf_init(&name);
 	sbuf_init(&def);
+	tok_preview(&name);
 	tok_macrodef(&def);
-	src_define(name, sbuf_buf(&def));
+	src_define(sbuf_buf(&name), sbuf_buf(&def));
+	sbuf_done(&name);
 	sbuf_done(&def);
 }
 
 /* return 1 if inside inline equations */
 int tok_inline(void)
 {
-	return tok_line;
+	return ctx->tok_line;
+}
+
+void tok_done(void)
+{
+	sbuf_done(&ctx->tok);
+	sbuf_done(&ctx->tok_prev);
 }